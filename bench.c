@@ -0,0 +1,486 @@
+/* Load generator for the server.
+
+    bench [-b batch] [-c receivers] [-f folks_every] [-h host] [-n messages]
+          [-r rate] [-s senders] [-S] <port>
+
+Senders each send 'messages' messages, 'batch' to a write, as fast as the
+server takes them or at 'rate' messages per second in all. Every message
+carries the time it was sent. Receivers poll with 'new', or subscribe with
+-S, asking for 'folks' every 'folks_every' polls, and take the end-to-end
+latency of every message they get. The rate the server stores messages
+at is taken from the first receiver to get them all, the one the senders
+wrote them at is only what the clients managed. The server's CPU time
+comes from 'stats' before and after the run. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define INPUT_BUFFER_SIZE  (64 << 10)
+#define LINE_LENGTH        64
+#define SUB_BUCKETS        16
+#define BUCKETS            (64 * SUB_BUCKETS)
+#define IDLE_TIMEOUT       2000
+
+static struct {
+  const char * host;
+  const char * port;
+  int receivers;
+  int senders;
+  unsigned long messages;
+  unsigned long batch;
+  unsigned long rate;
+  unsigned long folks_every;
+  int subscribe;
+} config;
+
+/* What a receiver is reading. */
+enum { REPLY_NONE, REPLY_NEW, REPLY_FOLKS, REPLY_PUSH };
+
+struct Client {
+  int fd;
+  int sender;
+  /* messages sent or got */
+  unsigned long messages;
+  unsigned long polls;
+  int reply;
+  /* lines due in the reply, -1 until its count has arrived */
+  long due;
+  char input[INPUT_BUFFER_SIZE];
+  size_t received;
+  char * output;
+  size_t queued, written;
+};
+
+static struct Client * clients;
+
+/* Log-linear: exact below SUB_BUCKETS, then SUB_BUCKETS per power of two,
+   good to about 6%. */
+static struct {
+  unsigned long counts[BUCKETS];
+  unsigned long total;
+  unsigned long max;
+} latency;
+
+/* When the first receiver had every message. */
+static struct {
+  struct timespec stored;
+  int complete;
+} receipts;
+
+static void
+die(const char * fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+  exit(EXIT_FAILURE);
+}
+
+static char *
+system_error(void) { return strerror(errno); }
+
+static struct timespec
+get_time(void) {
+  struct timespec time;
+  if (-1 == clock_gettime(CLOCK_REALTIME, &time)) {
+    die("'clock_gettime' failed: %s", system_error());
+  }
+  return time;
+}
+
+static double
+seconds_between(struct timespec from, struct timespec to) {
+  return to.tv_sec - from.tv_sec + (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+static int
+bucket_of(unsigned long value) {
+  int bits;
+  if (value < SUB_BUCKETS) return value;
+  for (bits = 0; value >> bits >= 2 * SUB_BUCKETS; ++bits) { }
+  return (bits + 1) * SUB_BUCKETS + (value >> bits) - SUB_BUCKETS;
+}
+
+/* The largest value in the bucket. */
+static unsigned long
+bucket_limit(int bucket) {
+  int bits;
+  if (bucket < SUB_BUCKETS) return bucket;
+  bits = bucket / SUB_BUCKETS - 1;
+  return ((unsigned long) (bucket % SUB_BUCKETS + SUB_BUCKETS + 1) << bits)
+    - 1;
+}
+
+static void
+record_latency(unsigned long nanoseconds) {
+  ++latency.counts[bucket_of(nanoseconds)];
+  ++latency.total;
+  if (nanoseconds > latency.max) latency.max = nanoseconds;
+}
+
+static unsigned long
+percentile(double fraction) {
+  unsigned long seen, wanted;
+  int bucket;
+  wanted = latency.total * fraction;
+  for (seen = 0, bucket = 0; bucket < BUCKETS; ++bucket) {
+    seen += latency.counts[bucket];
+    if (seen > wanted) return MIN(bucket_limit(bucket), latency.max);
+  }
+  return latency.max;
+}
+
+static int
+connect_to_server(void) {
+  struct addrinfo hints, * addresses, * address;
+  int fd, error;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  error = getaddrinfo(config.host, config.port, &hints, &addresses);
+  if (error) die("'getaddrinfo' failed: %s", gai_strerror(error));
+  for (fd = -1, address = addresses; address && -1 == fd;
+      address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype,
+      address->ai_protocol);
+    if (-1 == fd) continue;
+    if (-1 == connect(fd, address->ai_addr, address->ai_addrlen)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (-1 == fd) die("Could not connect to %s:%s", config.host, config.port);
+  return fd;
+}
+
+static void
+send_all(int fd, const char * data, size_t size) {
+  ssize_t sent;
+  while (size) {
+    sent = write(fd, data, size);
+    if (-1 == sent) {
+      if (EINTR == errno) continue;
+      die("'write' failed: %s", system_error());
+    }
+    data += sent;
+    size -= sent;
+  }
+}
+
+/* Asks for the server's CPU time, in microseconds, over a connection of
+   its own. */
+static unsigned long
+server_cpu_time(void) {
+  char input[4096], * line, * end;
+  size_t used;
+  ssize_t received;
+  unsigned long value;
+  int fd;
+  fd = connect_to_server();
+  send_all(fd, "stats\r\n", 7);
+  for (used = 0; ; used += received) {
+    if (used == sizeof(input) - 1) die("Reply to 'stats' too long");
+    received = read(fd, input + used, sizeof(input) - 1 - used);
+    if (-1 == received && EINTR == errno) received = 0;
+    else if (received <= 0) die("No reply to 'stats'");
+    input[used + received] = '\0';
+    if ((line = strstr(input, "cpu_microseconds ")) &&
+        strstr(line, "\r\n")) {
+      break;
+    }
+  }
+  close(fd);
+  value = strtoul(line + 17, &end, 10);
+  return value;
+}
+
+static void
+set_nonblocking(int fd) {
+  int flags;
+  flags = fcntl(fd, F_GETFL);
+  if (-1 == flags || -1 == fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+    die("'fcntl' failed: %s", system_error());
+  }
+}
+
+static void
+queue(struct Client * client, const char * data) {
+  size_t size;
+  size = strlen(data);
+  memcpy(client->output + client->queued, data, size);
+  client->queued += size;
+}
+
+/* Queues the next batch of a sender, as many messages as the rate allows
+   by 'now'. */
+static void
+queue_batch(struct Client * client, struct timespec start,
+    struct timespec now) {
+  char line[LINE_LENGTH];
+  unsigned long allowed, n;
+  struct timespec sent;
+  allowed = config.messages - client->messages;
+  if (config.rate) {
+    n = seconds_between(start, now) * config.rate / config.senders + 1;
+    allowed = n > client->messages ? MIN(allowed, n - client->messages) : 0;
+  }
+  client->queued = client->written = 0;
+  for (n = 0; n < MIN(allowed, config.batch); ++n) {
+    sent = get_time();
+    sprintf(line, "send %ld.%09ld\r\n", (long) sent.tv_sec, sent.tv_nsec);
+    queue(client, line);
+  }
+  client->messages += n;
+}
+
+static void
+ask(struct Client * client) {
+  client->due = -1;
+  if (config.folks_every && !(++client->polls % config.folks_every)) {
+    client->reply = REPLY_FOLKS;
+    queue(client, "folks\r\n");
+  } else {
+    client->reply = REPLY_NEW;
+    queue(client, "new\r\n");
+  }
+}
+
+static void
+process_line(struct Client * client, char * line, struct timespec now) {
+  char * text, * end;
+  struct timespec sent;
+  if (-1 == client->due) {
+    if ('+' == *line) client->reply = REPLY_PUSH;
+    client->due = strtol(line + (REPLY_PUSH == client->reply), &end, 10);
+  } else {
+    --client->due;
+    if (REPLY_FOLKS != client->reply &&
+        (text = strstr(line, ": "))) {
+      sent.tv_sec = strtol(text + 2, &end, 10);
+      sent.tv_nsec = strtol(end + 1, &end, 10);
+      record_latency(seconds_between(sent, now) * 1e9);
+      if (++client->messages == config.messages * config.senders &&
+          !receipts.complete) {
+        receipts.stored = now;
+        receipts.complete = 1;
+      }
+    }
+  }
+  if (client->due) return;
+  if (config.subscribe) client->due = -1;
+  else ask(client);
+}
+
+static void
+handle_input(struct Client * client, struct timespec now) {
+  char * begin, * end;
+  ssize_t received;
+  received = read(client->fd, client->input + client->received,
+    sizeof(client->input) - client->received);
+  if (-1 == received) {
+    if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno) return;
+    die("'read' failed: %s", system_error());
+  }
+  if (!received) die("The server closed a connection");
+  client->received += received;
+  for (begin = client->input;
+      (end = memchr(begin, '\n', client->input + client->received - begin));
+      begin = end + 1) {
+    end[-1] = '\0';
+    process_line(client, begin, now);
+  }
+  client->received -= begin - client->input;
+  memmove(client->input, begin, client->received);
+}
+
+static void
+handle_output(struct Client * client) {
+  ssize_t written;
+  written = write(client->fd, client->output + client->written,
+    client->queued - client->written);
+  if (-1 == written) {
+    if (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno) return;
+    die("'write' failed: %s", system_error());
+  }
+  client->written += written;
+  if (client->written == client->queued) client->queued = client->written = 0;
+}
+
+static void
+open_clients(void) {
+  char line[LINE_LENGTH];
+  struct Client * client;
+  int i, n;
+  n = config.senders + config.receivers;
+  if (!(clients = calloc(n, sizeof(*clients)))) die("Out of memory");
+  for (i = 0; i < n; ++i) {
+    client = &clients[i];
+    client->sender = i < config.senders;
+    client->output = malloc(client->sender ? config.batch * LINE_LENGTH
+      : LINE_LENGTH);
+    if (!client->output) die("Out of memory");
+    client->fd = connect_to_server();
+    sprintf(line, "my name is %c%d\r\n", client->sender ? 's' : 'r', i);
+    send_all(client->fd, line, strlen(line));
+    if (!client->sender) {
+      if (config.subscribe) {
+        client->due = -1;
+        send_all(client->fd, "subscribe\r\n", 11);
+      } else {
+        ask(client);
+        send_all(client->fd, client->output, client->queued);
+        client->queued = 0;
+      }
+    }
+    set_nonblocking(client->fd);
+  }
+}
+
+/* Runs until every receiver has every message, or no message has arrived
+   for IDLE_TIMEOUT after the senders finished. */
+static void
+run(struct timespec * start, struct timespec * written,
+    struct timespec * finished) {
+  struct pollfd * sockets;
+  struct Client * client;
+  struct timespec now, last;
+  unsigned long expected, delivered, sent, seen;
+  int i, n, paced, pending, done;
+  n = config.senders + config.receivers;
+  if (!(sockets = calloc(n, sizeof(*sockets)))) die("Out of memory");
+  expected = config.messages * config.senders;
+  *start = last = *written = get_time();
+  seen = 0;
+  while (1) {
+    now = get_time();
+    paced = pending = 0;
+    for (sent = delivered = 0, i = 0; i < n; ++i) {
+      client = &clients[i];
+      if (client->sender) {
+        if (!client->queued && client->messages < config.messages) {
+          queue_batch(client, *start, now);
+          paced |= !client->queued;
+        }
+        pending |= client->queued > 0;
+        sent += client->messages;
+      } else {
+        delivered += client->messages;
+      }
+      sockets[i].fd = client->fd;
+      sockets[i].events = POLLIN | (client->queued ? POLLOUT : 0);
+    }
+    /* receivers that fell behind the retention never get everything */
+    if (delivered > seen) {
+      seen = delivered;
+      last = now;
+    }
+    done = sent == expected && !pending;
+    if (!done) *written = now;
+    if (done && (delivered == expected * config.receivers ||
+        seconds_between(last, now) * 1000 > IDLE_TIMEOUT)) {
+      break;
+    }
+    if (-1 == poll(sockets, n, paced ? 1 : 100)) {
+      if (EINTR == errno) continue;
+      die("'poll' failed: %s", system_error());
+    }
+    now = get_time();
+    for (i = 0; i < n; ++i) {
+      if (sockets[i].revents & (POLLERR | POLLHUP)) {
+        die("Lost a connection");
+      }
+      if (sockets[i].revents & POLLIN) handle_input(&clients[i], now);
+      if (sockets[i].revents & POLLOUT) handle_output(&clients[i]);
+    }
+  }
+  *finished = get_time();
+  free(sockets);
+}
+
+static void
+report(struct timespec start, struct timespec written,
+    struct timespec finished, unsigned long cpu) {
+  unsigned long expected, delivered;
+  double elapsed;
+  int i;
+  expected = config.messages * config.senders;
+  for (delivered = 0, i = config.senders;
+      i < config.senders + config.receivers; ++i) {
+    delivered += clients[i].messages;
+  }
+  elapsed = seconds_between(start, finished);
+  printf("%d senders, %d receivers (%s)\n", config.senders,
+    config.receivers, config.subscribe ? "subscribed" : "polling");
+  printf("sent      %lu messages in %.3f s, %.0f msgs/s written\n",
+    expected, seconds_between(start, written),
+    expected / seconds_between(start, written));
+  if (receipts.complete) {
+    printf("stored    %lu messages in %.3f s, %.0f msgs/s received\n",
+      expected, seconds_between(start, receipts.stored),
+      expected / seconds_between(start, receipts.stored));
+  }
+  printf("delivered %lu of %lu in %.3f s, %.0f msgs/s\n", delivered,
+    expected * config.receivers, elapsed, delivered / elapsed);
+  if (latency.total) {
+    printf("latency   p50 %lu us, p99 %lu us, p999 %lu us, max %lu us\n",
+      percentile(0.5) / 1000, percentile(0.99) / 1000,
+      percentile(0.999) / 1000, latency.max / 1000);
+  }
+  printf("server    %lu us CPU, %.2f us per message sent, "
+    "%.3f us per message delivered\n", cpu, (double) cpu / expected,
+    delivered ? (double) cpu / delivered : 0);
+}
+
+int
+main(int argc, char * argv[]) {
+  struct timespec start, written, finished;
+  unsigned long cpu;
+  int option;
+  config.host = "127.0.0.1";
+  config.receivers = 16;
+  config.senders = 4;
+  config.messages = 10000;
+  config.batch = 16;
+  config.folks_every = 100;
+  while (-1 != (option = getopt(argc, argv, "b:c:f:h:n:r:s:S"))) {
+    switch (option) {
+    case 'b': config.batch = strtoul(optarg, NULL, 10); break;
+    case 'c': config.receivers = atoi(optarg); break;
+    case 'f': config.folks_every = strtoul(optarg, NULL, 10); break;
+    case 'h': config.host = optarg; break;
+    case 'n': config.messages = strtoul(optarg, NULL, 10); break;
+    case 'r': config.rate = strtoul(optarg, NULL, 10); break;
+    case 's': config.senders = atoi(optarg); break;
+    case 'S': config.subscribe = 1; break;
+    default: optind = argc;
+    }
+  }
+  if (optind != argc - 1 || config.senders < 1 || config.receivers < 0 ||
+      !config.batch || !config.messages) {
+    die("Usage: %s [-b batch] [-c receivers] [-f folks_every] [-h host] "
+      "[-n messages] [-r rate] [-s senders] [-S] <port>", argv[0]);
+  }
+  config.port = argv[optind];
+  cpu = server_cpu_time();
+  open_clients();
+  run(&start, &written, &finished);
+  cpu = server_cpu_time() - cpu;
+  report(start, written, finished, cpu);
+  return EXIT_SUCCESS;
+}
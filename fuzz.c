@@ -0,0 +1,881 @@
+/* Fuzz target and stress run for the server, built from its own source.
+
+    fuzz [file...]
+    fuzz -s seed [-c connections] [-n rounds]
+
+Given files, or stdin without any, it feeds each to a connection of its
+own as a client would send it, in writes of a size picked by the first
+byte, turns the event loop until the replies stop, hangs up and checks that
+every buffer went back to the pool. That is what AFL runs (make fuzz
+CC=afl-clang-fast); built with -DLIBFUZZER -fsanitize=fuzzer,
+LLVMFuzzerTestOneInput() does the same for libFuzzer.
+
+With a seed it drives 'connections' clients through the event loop for
+'rounds' rounds, over a Unix socket, which unlike loopback TCP delivers
+every write before it returns. Each sends commands picked by a generator
+started from the seed, split at random: valid ones mostly, some switch to
+binary frames or compression, read slowly, hang up, or send garbage and
+connect again. Every reply is checked against the command it answers, and
+the run ends printing a digest of them all, times and counters left out,
+which a changed server built for the same event backend and run with the
+same seed should print too. It all happens on one thread, a turn of the
+event loop a round. */
+
+#define main serve
+#include "server.c"
+#undef main
+
+#define CLIENT_INPUT_SIZE  (64 << 10)
+#define CLIENT_OUTPUT_SIZE 4096
+#define MAX_DUE            64
+#define ROOMS              8
+#define STRESS_HISTORY     1000
+#define FLUSH_ROUNDS       1000
+#define UNKNOWN_FRAME      0xff
+#define FNV_PRIME          ((uint64_t) 1 << 40 | 0x1b3)
+#define XORSHIFT_FACTOR    ((uint64_t) 0x2545f491UL << 32 | 0x4f6cdd1dUL)
+
+/* What a client waits for: replies to commands, in the order they were
+   sent, then the items of the one it is reading. */
+enum {
+  DUE_MESSAGES, DUE_FOLKS, DUE_COUNT, DUE_STATS, DUE_BINARY, DUE_COMPRESS
+};
+enum { READ_MESSAGES, READ_NICKS, READ_CHANGES, READ_STATS };
+
+struct Client {
+  int fd;
+  /* sent 'binary', and got the reply */
+  int binary;
+  int reading_binary;
+  int compressed;
+  /* sent something the server closes the connection for */
+  int closing;
+  /* rounds left without reading */
+  int slow;
+  /* rooms joined, a bit each */
+  unsigned rooms;
+  unsigned long messages;
+  int due[MAX_DUE];
+  int first_due, dues;
+  int reading;
+  /* items of the reply being read still to come, whether none has yet */
+  unsigned long items;
+  int first_item;
+  /* bytes of a compressed stream of them to come */
+  unsigned long compressed_bytes;
+  char input[CLIENT_INPUT_SIZE];
+  size_t received;
+  char output[CLIENT_OUTPUT_SIZE];
+  size_t queued, written;
+};
+
+static struct {
+  int connections;
+  unsigned long rounds;
+  struct sockaddr_un address;
+  uint64_t random;
+  uint64_t digest;
+  unsigned long commands;
+  unsigned long replies;
+  unsigned long reconnects;
+} stress;
+
+/* The listening socket is in the abstract namespace, named after the
+   process. */
+static int
+open_unix_listener(void) {
+  int fd;
+  memset(&stress.address, 0, sizeof(stress.address));
+  stress.address.sun_family = AF_UNIX;
+  sprintf(stress.address.sun_path + 1, "chat-fuzz-%ld", (long) getpid());
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (-1 == fd) die("'socket' failed: %s", system_error());
+  if (-1 == bind(fd, (struct sockaddr *) &stress.address,
+      sizeof(stress.address))) {
+    die("'bind' failed: %s", system_error());
+  }
+  if (-1 == listen(fd, config.backlog)) {
+    die("'listen' failed: %s", system_error());
+  }
+  return fd;
+}
+
+static void
+set_up(unsigned long retention) {
+  init_config();
+  config.workers = config.threads = 1;
+  /* nothing is evicted while the harness is busy elsewhere */
+  config.eviction_timeout = 1000000;
+  config.high_watermark = 16 << 10;
+  config.low_watermark = 4 << 10;
+  signal(SIGPIPE, SIG_IGN);
+  raise_descriptor_limit();
+  if (-1 == init_history(&lobby, retention, HISTORY_BLOCK_LENGTH)) {
+    die("Out of memory");
+  }
+  init_roster();
+  init_rooms();
+  init_federation(0);
+  init_stats();
+  workers = calloc(1, sizeof(workers[0]));
+  if (!workers) die("Out of memory");
+  workers[0].epoch = EPOCH_OFFLINE;
+  workers[0].listener = open_unix_listener();
+  open_wakeup(workers[0].wakeup);
+  start_worker(&workers[0]);
+}
+
+/* Reads whatever the server has sent to 'fd', to no end. */
+static void
+drain(int fd) {
+  char discarded[4096];
+  while (0 < read(fd, discarded, sizeof(discarded))) { }
+}
+
+static void
+fuzz(const unsigned char * data, size_t size) {
+  int pair[2], entry, turns;
+  size_t at, part, split;
+  ssize_t written;
+  if (-1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair)) {
+    die("'socketpair' failed: %s", system_error());
+  }
+  if (-1 == (entry = join_roster("anonym", 0))) die("The roster is full");
+  open_connection(pair[0], entry);
+  split = size ? 1 + *data++ : 1;
+  if (size) --size;
+  for (at = 0; at < size; at += written) {
+    part = MIN(split, size - at);
+    written = write(pair[1], data + at, part);
+    if (-1 == written) {
+      if (EAGAIN != errno && EWOULDBLOCK != errno) break;
+      written = 0;
+    }
+    serve_events(0);
+    drain(pair[1]);
+  }
+  for (turns = 0; turns < 4; ++turns) {
+    serve_events(0);
+    drain(pair[1]);
+  }
+  close(pair[1]);
+  serve_events(0);
+  serve_events(0);
+  if (pool.used) die("%lu bytes of buffers leaked", (unsigned long) pool.used);
+}
+
+#ifdef LIBFUZZER
+int
+LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+  static int ready;
+  if (!ready) {
+    set_up(MAX_HISTORY_LENGTH);
+    ready = 1;
+  }
+  fuzz(data, size);
+  return 0;
+}
+#else
+static struct Client * clients;
+
+/* xorshift64* */
+static unsigned long
+random_below(unsigned long n) {
+  stress.random ^= stress.random >> 12;
+  stress.random ^= stress.random << 25;
+  stress.random ^= stress.random >> 27;
+  return (stress.random * XORSHIFT_FACTOR >> 32) % n;
+}
+
+/* FNV-1a */
+static void
+digest(int kind, const char * bytes, size_t size) {
+  size_t i;
+  stress.digest = (stress.digest ^ (unsigned char) kind) * FNV_PRIME;
+  for (i = 0; i < size; ++i) {
+    stress.digest = (stress.digest ^ (unsigned char) bytes[i]) * FNV_PRIME;
+  }
+}
+
+#ifdef USE_ZLIB
+/* Inflates the 'size' bytes at 'bytes', returns the output, which ends
+   with a NUL past 'length', or NULL for a broken stream. */
+static char *
+inflate_all(const char * bytes, size_t size, size_t * length) {
+  z_stream stream;
+  char * output, * grown;
+  size_t capacity;
+  int result;
+  memset(&stream, 0, sizeof(stream));
+  if (Z_OK != inflateInit(&stream)) die("'inflateInit' failed");
+  capacity = 4 * size + 64;
+  output = NULL;
+  stream.next_in = (Bytef *) bytes;
+  stream.avail_in = size;
+  do {
+    capacity *= 2;
+    if (!(grown = realloc(output, capacity + 1))) die("Out of memory");
+    output = grown;
+    stream.next_out = (Bytef *) output + stream.total_out;
+    stream.avail_out = capacity - stream.total_out;
+    result = inflate(&stream, Z_FINISH);
+  } while ((Z_OK == result || Z_BUF_ERROR == result) && !stream.avail_out);
+  *length = stream.total_out;
+  inflateEnd(&stream);
+  if (Z_STREAM_END != result || stream.avail_in) {
+    free(output);
+    return NULL;
+  }
+  output[*length] = '\0';
+  return output;
+}
+#endif
+
+static void
+fail(struct Client * client, const char * what) {
+  die("client %d: %s", (int) (client - clients), what);
+}
+
+static void
+expect(struct Client * client, int due) {
+  if (MAX_DUE == client->dues) fail(client, "too many replies due");
+  client->due[(client->first_due + client->dues++) % MAX_DUE] = due;
+}
+
+static int
+next_due(struct Client * client) {
+  int due;
+  if (!client->dues) fail(client, "a reply to no command");
+  due = client->due[client->first_due];
+  client->first_due = (client->first_due + 1) % MAX_DUE;
+  --client->dues;
+  ++stress.replies;
+  return due;
+}
+
+static void
+start_reading(struct Client * client, int reading, unsigned long items) {
+  client->reading = reading;
+  client->items = items;
+  client->first_item = 1;
+}
+
+/* Counts like "12" or "+3 lounge", the digits at least. */
+static unsigned long
+parse_count(struct Client * client, const char * at, const char ** end) {
+  unsigned long value;
+  char * stop;
+  if (*at < '0' || '9' < *at) fail(client, "a count expected");
+  value = strtoul(at, &stop, 10);
+  *end = stop;
+  return value;
+}
+
+static void
+check_line(struct Client * client, const char * line, size_t length) {
+  const char * end, * colon;
+  switch (client->reading) {
+  case READ_MESSAGES:
+    colon = length > TIMESTAMP_LENGTH + 1 ? strstr(line, ": ") : NULL;
+    if ('[' != line[0] || ']' != line[TIMESTAMP_LENGTH - 1] ||
+        ' ' != line[TIMESTAMP_LENGTH] || !colon) {
+      fail(client, "a broken message");
+    }
+    digest('m', line + TIMESTAMP_LENGTH, length - TIMESTAMP_LENGTH);
+    break;
+  case READ_NICKS:
+    if (MAX_NICK_LENGTH < length) fail(client, "a broken nick");
+    digest('n', line, length);
+    break;
+  case READ_CHANGES:
+    if (!length || ('+' != *line && '-' != *line)) {
+      fail(client, "a broken roster change");
+    }
+    digest('r', line, length);
+    break;
+  case READ_STATS:
+    if (!(end = strchr(line, ' ')) || end == line) {
+      fail(client, "a broken counter");
+    }
+    break;
+  }
+}
+
+static void
+check_text_reply(struct Client * client, const char * line, size_t length) {
+  const char * end;
+  unsigned long count;
+  int due;
+  switch (*line) {
+  case '+':
+    count = parse_count(client, line + 1, &end);
+    if (*end && (' ' != *end || !end[1])) fail(client, "a broken push");
+    digest('+', line, length);
+    start_reading(client, READ_MESSAGES, count);
+    return;
+  case '=':
+  case '*':
+    count = parse_count(client, line + 1, &end);
+    if (*end) fail(client, "a broken roster push");
+    digest(*line, line, length);
+    start_reading(client, '=' == *line ? READ_NICKS : READ_CHANGES, count);
+    return;
+  }
+  due = next_due(client);
+  if (DUE_BINARY == due || DUE_COMPRESS == due) {
+    if (DUE_BINARY == due && !strcmp(line, PACKAGE_BINARY)) {
+      client->reading_binary = 1;
+    } else if (DUE_COMPRESS == due &&
+        !strcmp(line, PACKAGE_COMPRESS " deflate")) {
+      client->compressed = 1;
+    } else if (DUE_BINARY == due || strcmp(line, PACKAGE_COMPRESS " none")) {
+      fail(client, "a wrong reply to a switch");
+    }
+    return;
+  }
+  count = parse_count(client, line, &end);
+  if (*end) fail(client, "a broken count");
+  if (DUE_STATS != due) digest('#', line, length);
+  if (DUE_MESSAGES == due) start_reading(client, READ_MESSAGES, count);
+  else if (DUE_FOLKS == due) start_reading(client, READ_NICKS, count);
+  else if (DUE_STATS == due) start_reading(client, READ_STATS, count);
+}
+
+/* Takes the lines of the compressed stream of a reply. */
+static void
+check_text_stream(struct Client * client, const char * bytes, size_t size) {
+#ifdef USE_ZLIB
+  char * text, * line, * end;
+  size_t length;
+  if (!(text = inflate_all(bytes, size, &length))) {
+    fail(client, "a broken compressed stream");
+  }
+  for (line = text; line < text + length; line = end + 2) {
+    if (!client->items) fail(client, "too many compressed lines");
+    if (!(end = strstr(line, "\r\n"))) fail(client, "a broken compressed line");
+    *end = '\0';
+    check_line(client, line, end - line);
+    --client->items;
+  }
+  free(text);
+  if (client->items) fail(client, "too few compressed lines");
+#else
+  (void) bytes; (void) size;
+  fail(client, "compressed output from a server without zlib");
+#endif
+}
+
+static unsigned long
+get_field(struct Client * client, const unsigned char ** at,
+    const unsigned char * end) {
+  unsigned long value;
+  int n;
+  n = get_varint(*at, end - *at, &value);
+  if (n <= 0) fail(client, "a broken number in a frame");
+  *at += n;
+  return value;
+}
+
+/* Nicks or roster changes, each a length byte and the nick, after the
+   sign of a change. */
+static void
+check_frame_nicks(struct Client * client, int kind, const unsigned char * at,
+    const unsigned char * end) {
+  const unsigned char * start;
+  unsigned long count;
+  count = get_field(client, &at, end);
+  while (count--) {
+    start = at;
+    if ('r' == kind && (at == end || ('+' != *at && '-' != *at))) {
+      fail(client, "a broken roster change frame");
+    }
+    if ('r' == kind) ++at;
+    if (at == end || end - at - 1 < *at || MAX_NICK_LENGTH < *at) {
+      fail(client, "a broken nick in a frame");
+    }
+    at += *at + 1;
+    digest(kind, (const char *) start, at - start);
+  }
+  if (at != end) fail(client, "bytes left in a frame");
+}
+
+static void
+check_frame_message(struct Client * client, const unsigned char * at,
+    const unsigned char * end) {
+  unsigned long sequence;
+  sequence = get_field(client, &at, end);
+  if (end - at < 14 || (size_t) (end - at) != 14U + at[12] + at[13]) {
+    fail(client, "a broken message frame");
+  }
+  digest('s', (const char *) &sequence, sizeof(sequence));
+  digest('m', (const char *) at + 12, end - at - 12);
+}
+
+/* Takes the message frames of the compressed stream of a reply. */
+static void
+check_frame_stream(struct Client * client, const unsigned char * bytes,
+    size_t size) {
+#ifdef USE_ZLIB
+  const unsigned char * at, * end;
+  unsigned long length;
+  char * frames;
+  size_t total;
+  int n;
+  if (!(frames = inflate_all((const char *) bytes, size, &total))) {
+    fail(client, "a broken compressed stream");
+  }
+  end = (unsigned char *) frames + total;
+  for (at = (unsigned char *) frames; at < end; at += n + length) {
+    n = get_varint(at, end - at, &length);
+    if (n <= 0 || !length || (unsigned long) (end - at - n) < length ||
+        FRAME_MESSAGE != at[n]) {
+      fail(client, "a broken compressed frame");
+    }
+    if (!client->items) fail(client, "too many compressed frames");
+    --client->items;
+    check_frame_message(client, at + n + 1, at + n + length);
+  }
+  free(frames);
+  if (client->items) fail(client, "too few compressed frames");
+#else
+  (void) bytes; (void) size;
+  fail(client, "compressed output from a server without zlib");
+#endif
+}
+
+static void
+check_frame(struct Client * client, const unsigned char * frame,
+    size_t length) {
+  const unsigned char * at, * end;
+  unsigned long count;
+  at = frame + 1;
+  end = frame + length;
+  if (client->items) {
+    if (FRAME_COMPRESSED == *frame && client->first_item) {
+      client->first_item = 0;
+      check_frame_stream(client, at, end - at);
+      return;
+    }
+    if (FRAME_MESSAGE != *frame) fail(client, "a message frame expected");
+    client->first_item = 0;
+    --client->items;
+    check_frame_message(client, at, end);
+    return;
+  }
+  switch (*frame) {
+  case FRAME_COUNT:
+  case FRAME_PUSH:
+  case FRAME_ROOM_PUSH:
+    if (FRAME_COUNT == *frame && DUE_MESSAGES != next_due(client)) {
+      fail(client, "a count of messages for another command");
+    }
+    count = get_field(client, &at, end);
+    if (FRAME_ROOM_PUSH == *frame &&
+        (at == end || (size_t) (end - at) != 1U + *at)) {
+      fail(client, "a broken room push");
+    }
+    digest(*frame, (const char *) at, end - at);
+    digest('#', (const char *) &count, sizeof(count));
+    start_reading(client, READ_MESSAGES, count);
+    return;
+  case FRAME_ROSTER:
+  case FRAME_ROSTER_RESET:
+    if (FRAME_ROSTER == *frame && DUE_FOLKS != next_due(client)) {
+      fail(client, "folks for another command");
+    }
+    check_frame_nicks(client, 'n', at, end);
+    return;
+  case FRAME_ROSTER_CHANGES:
+    check_frame_nicks(client, 'r', at, end);
+    return;
+  case FRAME_ROSTER_SIZE:
+    if (DUE_COUNT != next_due(client)) fail(client, "a count for another");
+    count = get_field(client, &at, end);
+    if (at != end) fail(client, "bytes left in a frame");
+    digest('#', (const char *) &count, sizeof(count));
+    return;
+  case FRAME_COUNTERS:
+    if (DUE_STATS != next_due(client)) fail(client, "stats for another");
+    count = get_field(client, &at, end);
+    while (count--) {
+      if (at == end || end - at - 1 < *at) fail(client, "a broken counter");
+      at += *at + 1;
+      get_field(client, &at, end);
+    }
+    if (at != end) fail(client, "bytes left in a frame");
+    return;
+  default:
+    fail(client, "a frame of an unknown type");
+  }
+}
+
+/* Checks everything complete in the input, leaves the rest. */
+static void
+check_input(struct Client * client) {
+  char * at, * end, * line;
+  unsigned long length;
+  int n;
+  at = client->input;
+  end = client->input + client->received;
+  while (at < end) {
+    if (client->reading_binary) {
+      n = get_varint((unsigned char *) at, end - at, &length);
+      if (-1 == n || (n && !length)) fail(client, "a broken frame length");
+      if (!n || (unsigned long) (end - at - n) < length) break;
+      check_frame(client, (unsigned char *) at + n, length);
+      at += n + length;
+    } else if (client->compressed_bytes) {
+      if ((unsigned long) (end - at) < client->compressed_bytes) break;
+      check_text_stream(client, at, client->compressed_bytes);
+      at += client->compressed_bytes;
+      client->compressed_bytes = 0;
+    } else {
+      if (!(line = memchr(at, '\n', end - at))) break;
+      if (line == at || '\r' != *--line) fail(client, "a line without CR");
+      *line = '\0';
+      if (!client->items) {
+        check_text_reply(client, at, line - at);
+      } else if ('~' == *at && client->first_item &&
+          READ_MESSAGES == client->reading) {
+        client->compressed_bytes = strtoul(at + 1, NULL, 10);
+        if (!client->compressed_bytes) fail(client, "a broken '~' line");
+        client->first_item = 0;
+      } else {
+        check_line(client, at, line - at);
+        --client->items;
+        client->first_item = 0;
+      }
+      at = line + 2;
+    }
+  }
+  client->received = end - at;
+  if (client->received == CLIENT_INPUT_SIZE) fail(client, "a reply too long");
+  memmove(client->input, at, client->received);
+}
+
+static void
+connect_client(struct Client * client) {
+  memset(client, 0, sizeof(*client));
+  client->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (-1 == client->fd) die("'socket' failed: %s", system_error());
+  if (-1 == connect(client->fd, (struct sockaddr *) &stress.address,
+      sizeof(stress.address))) {
+    die("'connect' failed: %s", system_error());
+  }
+  if (-1 == fcntl(client->fd, F_SETFL, O_NONBLOCK)) {
+    die("'fcntl' failed: %s", system_error());
+  }
+}
+
+static void
+hang_up(struct Client * client) {
+  close(client->fd);
+  client->fd = -1;
+  ++stress.reconnects;
+}
+
+/* Queues a command, as a line or as a frame of 'type', 0 for those only
+   sent as text. */
+static void
+put_command(struct Client * client, int type, const char * text,
+    const char * argument, int due) {
+  unsigned char * at;
+  size_t length;
+  at = (unsigned char *) client->output + client->queued;
+  length = strlen(argument);
+  if (length + strlen(text) + MAX_VARINT_LENGTH + 3 >
+      CLIENT_OUTPUT_SIZE - client->queued) {
+    return;
+  }
+  if (client->binary && type) {
+    at += put_varint(at, length + 1);
+    *at++ = type;
+  } else {
+    length += strlen(text) + 2;
+    sprintf((char *) at, "%s%s\r\n", text, argument);
+    at += length;
+    length = 0;
+  }
+  memcpy(at, argument, length);
+  client->queued = (char *) at + length - client->output;
+  if (!type && !strcmp(text, PACKAGE_BINARY)) client->binary = 1;
+  if (-1 != due) expect(client, due);
+  ++stress.commands;
+}
+
+/* Picks the next command of a client. Room commands are for rooms it is
+   in, those only fail on purpose. */
+static void
+generate_command(struct Client * client) {
+  char argument[MAX_MESSAGE_LENGTH + MAX_ROOM_LENGTH + 2];
+  unsigned long pick;
+  int room;
+  pick = random_below(100);
+  room = random_below(ROOMS);
+  if (pick < 25) {
+    sprintf(argument, "m%d-%lu %.*s", (int) (client - clients),
+      client->messages++, (int) random_below(100),
+      "padding padding padding padding padding padding padding padding "
+      "padding padding padding padding");
+    put_command(client, FRAME_SEND, PACKAGE_BEGIN_SEND, argument, -1);
+  } else if (pick < 35 && client->rooms & 1U << room) {
+    sprintf(argument, "r%d m%d-%lu", room, (int) (client - clients),
+      client->messages++);
+    put_command(client, FRAME_POST, PACKAGE_BEGIN_POST, argument, -1);
+  } else if (pick < 45) {
+    put_command(client, FRAME_NEW, PACKAGE_NEW, "", DUE_MESSAGES);
+  } else if (pick < 48 && !client->binary) {
+    put_command(client, FRAME_NEW_SINCE, PACKAGE_BEGIN_NEW_SINCE,
+      random_below(2) ? "0" : "99999999999", DUE_MESSAGES);
+  } else if (pick < 53 && client->rooms & 1U << room) {
+    sprintf(argument, "r%d", room);
+    put_command(client, FRAME_NEW_IN, PACKAGE_BEGIN_NEW_IN, argument,
+      DUE_MESSAGES);
+  } else if (pick < 58) {
+    sprintf(argument, "r%d", room);
+    put_command(client, FRAME_JOIN, PACKAGE_BEGIN_JOIN, argument, -1);
+    client->rooms |= 1U << room;
+  } else if (pick < 61) {
+    sprintf(argument, "r%d", room);
+    put_command(client, FRAME_LEAVE, PACKAGE_BEGIN_LEAVE, argument, -1);
+    client->rooms &= ~(1U << room);
+  } else if (pick < 64) {
+    put_command(client, FRAME_FOLKS, PACKAGE_FOLKS, "", DUE_FOLKS);
+  } else if (pick < 67 && !client->binary) {
+    sprintf(argument, "%lu %lu", random_below(stress.connections),
+      random_below(50));
+    put_command(client, FRAME_FOLKS_PAGE, PACKAGE_BEGIN_FOLKS_PAGE, argument,
+      DUE_FOLKS);
+  } else if (pick < 70) {
+    put_command(client, FRAME_FOLKS_COUNT, PACKAGE_FOLKS_COUNT, "",
+      DUE_COUNT);
+  } else if (pick < 73 && client->rooms & 1U << room) {
+    sprintf(argument, "r%d", room);
+    put_command(client, FRAME_FOLKS_IN, PACKAGE_BEGIN_FOLKS_IN, argument,
+      DUE_FOLKS);
+  } else if (pick < 77) {
+    put_command(client, FRAME_SUBSCRIBE, PACKAGE_SUBSCRIBE, "", -1);
+  } else if (pick < 80) {
+    put_command(client, FRAME_UNSUBSCRIBE, PACKAGE_UNSUBSCRIBE, "", -1);
+  } else if (pick < 83) {
+    put_command(client, FRAME_SUBSCRIBE_FOLKS, PACKAGE_SUBSCRIBE_FOLKS, "",
+      -1);
+  } else if (pick < 86) {
+    put_command(client, FRAME_UNSUBSCRIBE_FOLKS, PACKAGE_UNSUBSCRIBE_FOLKS,
+      "", -1);
+  } else if (pick < 91) {
+    sprintf(argument, "n%lu", random_below(1000));
+    put_command(client, FRAME_MY_NAME_IS, PACKAGE_BEGIN_MY_NAME_IS, argument,
+      -1);
+  } else if (pick < 92 && !client->binary) {
+    put_command(client, 0, PACKAGE_BINARY, "", DUE_BINARY);
+  } else if (pick < 94 && !client->binary) {
+    put_command(client, 0, PACKAGE_COMPRESS, "", DUE_COMPRESS);
+  } else if (pick < 95 && !random_below(4)) {
+    /* an unknown command, or a room the client is not in */
+    if (random_below(2)) {
+      put_command(client, UNKNOWN_FRAME, "bogus", "", -1);
+    } else {
+      sprintf(argument, "r%d", room);
+      put_command(client, FRAME_LEAVE, PACKAGE_BEGIN_LEAVE, argument, -1);
+      put_command(client, FRAME_NEW_IN, PACKAGE_BEGIN_NEW_IN, argument, -1);
+    }
+    client->closing = 1;
+  }
+}
+
+/* Writes a random part of the output of the client. */
+static void
+flush_client(struct Client * client) {
+  ssize_t written;
+  size_t part;
+  if (client->written == client->queued) return;
+  part = 1 + random_below(client->queued - client->written);
+  written = write(client->fd, client->output + client->written, part);
+  if (-1 == written) {
+    if (EAGAIN == errno || EWOULDBLOCK == errno) return;
+    if (!client->closing) die("'write' failed: %s", system_error());
+    client->written = client->queued;
+    return;
+  }
+  client->written += written;
+  if (client->written == client->queued) client->written = client->queued = 0;
+}
+
+/* Reads and checks what came for the client. */
+static void
+read_client(struct Client * client) {
+  ssize_t received;
+  while (1) {
+    received = read(client->fd, client->input + client->received,
+      CLIENT_INPUT_SIZE - client->received);
+    if (-1 == received && (EAGAIN == errno || EWOULDBLOCK == errno)) return;
+    if (received <= 0) {
+      if (!client->closing) fail(client, "the connection closed");
+      hang_up(client);
+      return;
+    }
+    client->received += received;
+    check_input(client);
+  }
+}
+
+static int
+done(struct Client * client) {
+  return -1 == client->fd || (!client->dues && !client->items &&
+    !client->compressed_bytes && client->written == client->queued);
+}
+
+static void
+run_round(struct Client * client, int generate) {
+  int commands;
+  if (-1 == client->fd) {
+    if (!generate) return;
+    connect_client(client);
+    return;
+  }
+  if (generate && !client->closing && client->dues < MAX_DUE / 2) {
+    if (!random_below(1000)) {
+      hang_up(client);
+      return;
+    }
+    if (!random_below(200)) client->slow = 1 + random_below(200);
+    if (client->written == client->queued && !random_below(4)) {
+      for (commands = 1 + random_below(4); commands--; ) {
+        generate_command(client);
+        if (client->closing) break;
+      }
+    }
+  }
+  if (!generate) client->slow = 0;
+  flush_client(client);
+}
+
+/* A round: the clients write, the server takes a turn, the clients read.
+   Returns whether any still waits for a reply. */
+static int
+turn(int generate) {
+  int i, busy;
+  for (i = 0; i < stress.connections; ++i) run_round(&clients[i], generate);
+  serve_events(0);
+  for (busy = 0, i = 0; i < stress.connections; ++i) {
+    if (-1 == clients[i].fd) continue;
+    if (clients[i].slow) --clients[i].slow;
+    else read_client(&clients[i]);
+    busy |= !done(&clients[i]);
+  }
+  return busy;
+}
+
+static void
+settle(void) {
+  int rounds;
+  for (rounds = 0; turn(0); ++rounds) {
+    if (FLUSH_ROUNDS == rounds) {
+      die("Replies still due after %d rounds", FLUSH_ROUNDS);
+    }
+  }
+}
+
+/* The counters differ from run to run, and so the size of the reply to
+   'stats': every client asks for them once all else is done, so they
+   change nothing else. */
+static void
+run_stress(void) {
+  unsigned long round;
+  int i;
+  config.max_connections = stress.connections;
+  set_up(STRESS_HISTORY);
+  clients = calloc(stress.connections, sizeof(clients[0]));
+  if (!clients) die("Out of memory");
+  for (i = 0; i < stress.connections; ++i) {
+    connect_client(&clients[i]);
+    if (63 == i % 64) serve_events(0);
+  }
+  for (round = 0; round < stress.rounds; ++round) turn(1);
+  settle();
+  for (i = 0; i < stress.connections; ++i) {
+    if (-1 == clients[i].fd || clients[i].closing) continue;
+    put_command(&clients[i], FRAME_STATS, PACKAGE_STATS, "", DUE_STATS);
+  }
+  settle();
+  for (i = 0; i < stress.connections; ++i) {
+    if (-1 != clients[i].fd) close(clients[i].fd);
+  }
+  for (i = 0; roster.count && i < FLUSH_ROUNDS; ++i) serve_events(0);
+  if (pool.used) die("%lu bytes of buffers leaked", (unsigned long) pool.used);
+  if (roster.count) die("%d left in the roster", roster.count);
+  printf("commands %lu replies %lu reconnects %lu digest %08lx%08lx\n",
+    stress.commands, stress.replies, stress.reconnects,
+    (unsigned long) (stress.digest >> 32),
+    (unsigned long) (stress.digest & 0xffffffffUL));
+}
+
+/* Reads all of 'file' into a buffer to be freed. */
+static unsigned char *
+read_all(FILE * file, size_t * size) {
+  unsigned char * data, * grown;
+  size_t capacity, got;
+  data = NULL;
+  capacity = *size = 0;
+  do {
+    if (*size == capacity) {
+      capacity = capacity ? 2 * capacity : 4096;
+      if (!(grown = realloc(data, capacity))) die("Out of memory");
+      data = grown;
+    }
+    got = fread(data + *size, 1, capacity - *size, file);
+    *size += got;
+  } while (got);
+  if (ferror(file)) die("Could not read the input");
+  return data;
+}
+
+int
+main(int argc, char * argv[]) {
+  unsigned char * data;
+  FILE * file;
+  size_t size;
+  char * end;
+  int option, i;
+  stress.connections = 1000;
+  stress.rounds = 1000;
+  while (-1 != (option = getopt(argc, argv, "c:n:s:"))) {
+    switch (option) {
+    case 'c':
+      stress.connections = strtol(optarg, &end, 10);
+      if (*end || stress.connections < 1) optind = argc + 1;
+      break;
+    case 'n':
+      stress.rounds = strtoul(optarg, &end, 10);
+      if (*end) optind = argc + 1;
+      break;
+    case 's':
+      stress.random = strtoul(optarg, &end, 10);
+      if (*end || !stress.random) optind = argc + 1;
+      break;
+    default:
+      optind = argc + 1;
+    }
+  }
+  if (optind > argc || (stress.random && optind != argc)) {
+    die("Usage: %s [file...]\n       %s -s seed [-c connections] "
+      "[-n rounds]", argv[0], argv[0]);
+  }
+  if (stress.random) {
+    run_stress();
+    return EXIT_SUCCESS;
+  }
+  set_up(MAX_HISTORY_LENGTH);
+  for (i = optind; i < argc || optind == argc; ++i) {
+    file = optind == argc ? stdin : fopen(argv[i], "rb");
+    if (!file) die("Could not open %s: %s", argv[i], system_error());
+    data = read_all(file, &size);
+    if (stdin != file) fclose(file);
+    fuzz(data, size);
+    free(data);
+    if (optind == argc) break;
+  }
+  return EXIT_SUCCESS;
+}
+#endif
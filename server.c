@@ -10,6 +10,27 @@ watching participants
     s> <nick1>
     s> <nick2>
 
+    c> folks count
+    s> 3
+
+a page of them: at most <limit> from position <from> on
+    c> folks 1 10
+    s> 2
+    s> <nick1>
+    s> <nick2>
+
+following participants: the current ones marked with '=', then every
+batch of joins ('+') and leaves ('-') marked with '*'; one who falls too far
+behind gets the current ones again
+    c> subscribe folks
+    s> =1
+    s> <nick>
+    s> *2
+    s> +<nick1>
+    s> -<nick>
+
+    c> unsubscribe folks
+
 sending messages
     c> send <message>
 
@@ -20,41 +41,315 @@ requesting new messages
 
     c> new
     s> 0
+
+requesting messages since a point in time (seconds since the Epoch)
+    c> new since 1700000000
+    s> 1
+    s> [03:14:48] <nick2>: <message1>
+
+subscribing to messages: undelivered ones and every later one are pushed
+as they arrive, in batches marked with '+' so they are never mistaken for
+a reply
+    c> subscribe
+    s> +1
+    s> [03:14:48] <nick2>: <message1>
+
+    c> unsubscribe
+
+talking in a room, made by the first to join it and gone, messages and
+all, once the last one leaves: its messages are kept apart from those of
+the lobby and only its members see them, subscribed ones get them pushed
+with the room after the count; posting, requesting and watching
+participants are for members. A join the server has no room or no memory
+for, or one past the rooms a connection can be in, gets an error marked
+with '!'
+    c> join <room>
+    c> post <room> <message>
+    s> +1 <room>
+    s> [03:14:48] <nick>: <message>
+
+    c> new in <room>
+    s> 0
+
+    c> folks in <room>
+    s> 1
+    s> <nick>
+
+    c> leave <room>
+
+    c> join <room>
+    s> !no room for <room>
+
+watching the counters of the server, summed over its workers, and the CPU
+time it has used; a histogram comes as a line per bucket in use, named
+after the bound the values in it are below
+    c> stats
+    s> 4
+    s> queued_bytes 0
+    s> paused_connections 0
+    s> ready_events_below_2 10
+    s> ready_events_below_4 3
+
+switching to binary frames for the rest of the connection
+    c> binary
+    s> binary
+
+compressing bulk output: from then on the messages of a reply or a push
+taking more than 4096 bytes come as one zlib stream, announced by '~' and
+its length and followed by that many bytes, which inflate to the lines that
+would have been sent; 'none' when the server is built without zlib
+    c> compress
+    s> compress deflate
+    c> new
+    s> 5000
+    s> ~61440
+    s> <61440 bytes>
+
+linking servers into one chat: a server started with peers (-p) connects
+to each, says the number of its next message and gets back the first one
+the peer is missing, then streams the lobby messages of its own clients
+and their joins and leaves, in batches; a link that breaks picks up where
+it stopped. Relayed messages are stored like the others but not relayed
+on, and the folks of a peer are listed with the local ones while its link
+lasts. Rooms stay on their server. Relays are numbered on from the last
+'at'. A server takes links only from the hosts of its own peers, and the
+relays, joins and leaves of a link take from its 'relay' limit (-q).
+    c> peer <name> <next>
+    s> <first wanted>
+    c> joined <nick>
+    c> at <sequence>
+    c> relay <nick length> <nick> <message>
+    c> left <nick>
+
+A binary frame is a varint length, 7 bits a byte starting with the lowest,
+the high bit set on all but the last, followed by that many bytes: a type
+byte and its fields. Numbers are varints, but times are 8 bytes of seconds
+since the Epoch and 4 of nanoseconds, little-endian. The client sends
+    1 <nick>                        my name is
+    2                               folks
+    3 <message>                     send
+    4                               new
+    5 <seconds>                     new since
+    6                               subscribe
+    7                               unsubscribe
+    8                               stats
+    9 <from> <limit>                folks <from> <limit>
+    10                              folks count
+    11                              subscribe folks
+    12                              unsubscribe folks
+    13 <room>                       join
+    14 <room>                       leave
+    15 <room> <message>             post
+    16 <room>                       new in
+    17 <room>                       folks in
+and gets, in place of the text replies,
+    1 <count>                       count of the messages following
+    2 <count>                       the same for a push
+    3 <sequence> <time> <nick length byte> <message length byte> <nick>
+      <message>
+    4 <count>, then per nick: <length byte> <nick>
+    5 <count>, then per counter: <name length byte> <name> <value>
+    6 <count>                       folks count
+    7 <count>, then per change: <'+' or '-'> <length byte> <nick>
+    8 like 4, the current participants of a follower
+    9 <count> <room length byte> <room>
+                                    the same as 2 for a push in a room
+    10 <text>                       an error, the line without the '!'
+    11 <zlib stream>                the frames of the messages after a
+                                    count, compressed
 */
 
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
+
+/* Event backend: epoll on Linux unless told otherwise, io_uring on request
+   (-DUSE_IO_URING), poll() everywhere else (-DUSE_POLL forces it). */
+#if !defined(USE_POLL) && !defined(USE_IO_URING) && defined(__linux__)
+#define USE_EPOLL
+#endif
+#if !defined(USE_EPOLL) && !defined(USE_IO_URING) && !defined(USE_POLL)
+#define USE_POLL
+#endif
+#ifdef USE_IO_URING
+#define _DEFAULT_SOURCE
+#endif
+/* accept4() */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+/* Compression is only there when built with zlib (-DUSE_ZLIB, -lz), as
+   'make ZLIB=1' does. */
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
 
 #include <assert.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Clocks read at most a tick stale, but without a system call. */
+#ifndef CLOCK_REALTIME_COARSE
+#define CLOCK_REALTIME_COARSE CLOCK_REALTIME
+#endif
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#endif
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
 
-#define TIMESTAMP_LENGTH   10
+/* Sizes of the fixed records, compiled in so the tables, blocks and
+   buffers are laid out at build time; a build may set its own with -D.
+   Journals only load in a build with the same history block. */
+#ifndef BUFFER_POOL_SIZE
 #define BUFFER_POOL_SIZE   128
-#define MAX_CONNECTIONS    64
+#endif
+#ifndef SMALL_BUFFER_SIZE
+#define SMALL_BUFFER_SIZE  192
+#endif
+#ifndef LARGE_BUFFER_SIZE
+#define LARGE_BUFFER_SIZE  4096
+#endif
+#ifndef MAX_MESSAGE_LENGTH
 #define MAX_MESSAGE_LENGTH 140
+#endif
+#ifndef MAX_NICK_LENGTH
 #define MAX_NICK_LENGTH    20
+#endif
+#ifndef MAX_ROOM_LENGTH
+#define MAX_ROOM_LENGTH    20
+#endif
+#ifndef MAX_MEMBERSHIPS
+#define MAX_MEMBERSHIPS    16
+#endif
+#ifndef HISTORY_BLOCK_LENGTH
+#define HISTORY_BLOCK_LENGTH 1024
+#endif
+
+#define TIMESTAMP_LENGTH   10
+#define MAX_POOL_MEMORY    (64UL << 20)
+#define MAX_CONNECTIONS    100000
+#define CONNECTIONS_CHUNK  64
+#define RESERVED_DESCRIPTORS 16
+#define READY_BATCH        256
+#define MAX_ROOMS          4096
 #define MAX_HISTORY_LENGTH 50
+#define MAX_SPARE_BLOCKS   4
+#define MAX_CONFIG_LINE    4096
 #define MAX_PACKAGE_LENGTH \
   (TIMESTAMP_LENGTH + MAX_NICK_LENGTH + MAX_MESSAGE_LENGTH + 3)
+#define MAX_RENDERED_LENGTH (MAX_PACKAGE_LENGTH + 2)
+#define URING_ENTRIES      256
+#define IOV_BATCH          64
+#define HIGH_WATERMARK     (256UL << 10)
+#define LOW_WATERMARK      (64UL << 10)
+#define EVICTION_TIMEOUT   30
+#define TIMER_BITS         6
+#define TIMER_SLOTS        (1 << TIMER_BITS)
+#define TIMER_LEVELS       4
+#define INPUT_BUFFER_SIZE  (16UL << 10)
+#define COMPRESS_THRESHOLD 4096
+#define URING_TIMER_TAG    1
+#define WAKEUP_SLOT        1
+#define FIRST_CLIENT       2
+#define MAX_WORKERS        256
+#define OFFSET_BITS        20
+#define EPOCH_OFFLINE      ULONG_MAX
+#define MAX_FRAME_LENGTH   (MAX_ROOM_LENGTH + MAX_MESSAGE_LENGTH + 2)
+#define MAX_MESSAGE_FRAME  (MAX_NICK_LENGTH + MAX_MESSAGE_LENGTH + 32)
+#define MAX_VARINT_LENGTH  10
+#define MAX_COMMANDS       32
+#define HISTOGRAM_BUCKETS  (sizeof(unsigned long) * CHAR_BIT)
+#define MAX_STAT_NAME      64
+#define ROSTER_CHANGES     4096
+#define UPGRADE_VERSION    1
+#define UPGRADE_CHUNK      (32UL << 10)
+#define MAX_PEERS          64
+#define MAX_PEER_NAME      64
+#define LINK_RETRY         1000
+#define LINK_TIMEOUT       5000
+#define MAX_LIMIT          65535
+#define MAX_UPGRADE_RECORD \
+  (MAX_NICK_LENGTH + MAX_MEMBERSHIPS * (MAX_ROOM_LENGTH + 1) + \
+    3 * MAX_VARINT_LENGTH + 4)
+
+/* Lengths go out in a byte, and a full block must fit the offset bits of
+   the tail of a history. */
+typedef char lengths_fit_a_byte[MAX_NICK_LENGTH < 256 &&
+  MAX_ROOM_LENGTH < 256 && MAX_MESSAGE_LENGTH < 256 ? 1 : -1];
+typedef char blocks_fit_the_offset[HISTORY_BLOCK_LENGTH *
+  MAX_RENDERED_LENGTH < 1UL << OFFSET_BITS ? 1 : -1];
+
+/* Types of the binary frames a client sends, then of those it gets. */
+enum {
+  FRAME_MY_NAME_IS = 1, FRAME_FOLKS, FRAME_SEND, FRAME_NEW, FRAME_NEW_SINCE,
+  FRAME_SUBSCRIBE, FRAME_UNSUBSCRIBE, FRAME_STATS, FRAME_FOLKS_PAGE,
+  FRAME_FOLKS_COUNT, FRAME_SUBSCRIBE_FOLKS, FRAME_UNSUBSCRIBE_FOLKS,
+  FRAME_JOIN, FRAME_LEAVE, FRAME_POST, FRAME_NEW_IN, FRAME_FOLKS_IN
+};
+enum { FRAME_COUNT = 1, FRAME_PUSH, FRAME_MESSAGE, FRAME_ROSTER,
+  FRAME_COUNTERS, FRAME_ROSTER_SIZE, FRAME_ROSTER_CHANGES, FRAME_ROSTER_RESET,
+  FRAME_ROOM_PUSH, FRAME_ERROR, FRAME_COMPRESSED };
 
+/* Input read but not processed yet, config.input_buffer bytes of 'data'.
+   A connection only holds one while some is left. */
 struct Buffer {
-  char data[MAX_PACKAGE_LENGTH];
-  int used;
+  struct Buffer * next;
+  char * data;
+  size_t used;
+  /* bytes before this have been searched for the end of a package */
+  size_t scanned;
 };
 
+enum { SLICE_BUFFER, SMALL_BUFFER, LARGE_BUFFER, BUFFER_CLASSES };
+
+/* A piece of pending output: bytes copied into 'storage', or, when 'block'
+   is set, a slice of that history block, which stays referenced until the
+   slice has been sent. Either way the piece is 'used' bytes at 'data', of
+   which 'sent' have been written already. Slices have no storage; small
+   and large buffers serve short replies and bulk ones. */
 struct LinkedBuffer {
-  struct Buffer buffer;
   struct LinkedBuffer * next;
+  struct HistoryBlock * block;
+  const char * data;
+  char * storage;
+  int capacity;
+  int used;
+  int sent;
+  int size_class;
 };
 
 struct ListOfBuffers {
@@ -62,33 +357,629 @@ struct ListOfBuffers {
   struct LinkedBuffer * last;
 };
 
-struct LinkedBuffer free_buffers[BUFFER_POOL_SIZE];
-struct LinkedBuffer * first_free_buffer;
+/* Classes of commands with a token bucket per connection: storing
+   messages, asking for the history or the roster, changing the roster or
+   the rooms one is in, and what a peer passes on over its link. */
+enum { LIMIT_SEND = 1, LIMIT_QUERY, LIMIT_ROSTER, LIMIT_RELAY, LIMIT_CLASSES };
 
-struct ConnectionData {
+static const char * const limit_names[LIMIT_CLASSES] = {
+  NULL, "send", "query", "roster", "relay"
+};
+
+struct Limit {
+  unsigned long rate;
+  unsigned long burst;
+};
+
+/* Settings from the command line or a config file, shared by all workers.
+   The buffer memory is split evenly between them. 'threads' counts the
+   workers, the journal writer and the links to peers, everything that
+   reads the history. */
+static struct {
+  int workers;
+  int threads;
+  int max_connections;
+  /* folks of the peers listed at most, over all of them */
+  int max_remote_folks;
+  size_t buffer_memory;
+  size_t input_buffer;
+  size_t high_watermark;
+  size_t low_watermark;
+  unsigned long eviction_timeout;
+  /* seconds without input a connection is closed after, 0 for never */
+  unsigned long idle_timeout;
+  int max_rooms;
+  unsigned long history_length;
+  unsigned long room_history_length;
+  unsigned long port;
+  /* from -o: the listen() backlog and the socket options, 0 leaves one as
+     the system has it */
+  int backlog;
+  int nodelay;
+  int defer_accept;
+  int send_buffer;
+  int receive_buffer;
+  int busy_poll;
+  /* from -q: tokens a tick and at most in store for each class of
+     commands, no limit without a rate */
+  struct Limit limits[LIMIT_CLASSES];
+} config;
+
+/* The options -o takes, as name=value, or a name alone for 1. */
+struct SocketOption {
+  const char * name;
+  int * value;
+};
+
+static const struct SocketOption socket_options[] = {
+  { "backlog", &config.backlog },
+  { "nodelay", &config.nodelay },
+  { "defer_accept", &config.defer_accept },
+  { "sndbuf", &config.send_buffer },
+  { "rcvbuf", &config.receive_buffer },
+  { "busy_poll", &config.busy_poll }
+};
+
+#define SOCKET_OPTIONS (sizeof(socket_options) / sizeof(socket_options[0]))
+
+/* Buffers of each class are carved BUFFER_POOL_SIZE at a time out of slabs
+   and recycled through per-class free lists. The limit is soft: a reply
+   always gets its buffers, but while more than 'limit' bytes are handed
+   out commands are not executed, the connections wait in the 'waiting'
+   list. Every worker has a pool of its own, its limit is its share of
+   config.buffer_memory. */
+static __thread struct {
+  struct LinkedBuffer * free[BUFFER_CLASSES];
+  struct Buffer * free_input;
+  size_t used;
+  size_t allocated;
+  size_t limit;
+  int waiting;
+} pool;
+
+static const int buffer_capacity[BUFFER_CLASSES] = {
+  0, SMALL_BUFFER_SIZE, LARGE_BUFFER_SIZE
+};
+
+/* Per-connection fields touched on every wakeup live in ConnectionState;
+   the bulky ones only a command needs stay in ConnectionData. */
+struct ConnectionState {
   unsigned closed : 1;
-  char nick[MAX_NICK_LENGTH + 1];
-  struct timespec last_received_message;
+  unsigned waiting : 1;
+  unsigned paused : 1;
+  unsigned subscribed : 1;
+  unsigned following : 1;
+  /* switched to binary frames */
+  unsigned binary : 1;
+  /* asked for bulk output compressed */
+  unsigned compressed : 1;
+  /* held back by a command over its limit until the next tick */
+  unsigned throttled : 1;
+  unsigned timed : 1;
+  /* level of the timer wheel the timer of the connection is in */
+  unsigned char timer_level;
+  /* bumped whenever the slot is released, stale events carry an old one */
+  unsigned generation;
+  /* link in the free list or in the list of connections to be cleaned */
+  int next;
+  /* link in the list of connections waiting for buffer memory */
+  int next_waiting;
+  /* links in the list of connections paused by their own backlog */
+  int previous_paused, next_paused;
+  /* link in the list of throttled connections whose timer went off */
+  int next_throttled;
+  /* links in the list of subscribed connections */
+  int previous_subscriber, next_subscriber;
+  /* links in the list of a slot of the timer wheel */
+  int previous_timer, next_timer;
+  unsigned long deadline;
+  /* ticks of the timer wheel when the backlog went over the high
+     watermark, and when input last came */
+  unsigned long paused_since;
+  unsigned long active;
+  /* bytes in pending_to_be_sent not written yet */
+  size_t queued;
   struct ListOfBuffers pending_to_be_sent;
-  struct Buffer input_buffer;
 };
 
-static struct {
-  struct pollfd sockets[MAX_CONNECTIONS];
-  struct ConnectionData data[MAX_CONNECTIONS];
+/* A room a connection has joined. The worker links the members of a room
+   it serves into a list, naming each by its connection and its slot in
+   the connection's 'memberships'. */
+struct Membership {
+  struct Room * room;
+  /* sequence number of the first message of the room not yet delivered */
+  unsigned long cursor;
+  /* place among the members of the room, under its lock */
+  int position;
+  /* links in the list of members of the room on this worker */
+  int previous, next;
+};
+
+/* Tokens taken and the tick the bucket was last topped up at. */
+struct Bucket {
+  unsigned taken;
+  unsigned long filled;
+};
+
+struct ConnectionData {
+  char nick[MAX_NICK_LENGTH + 1];
+  /* entry holding the nick in the roster */
+  int roster;
+  /* number of the first roster change not yet delivered to a follower */
+  unsigned long roster_cursor;
+  /* links in the list of followers */
+  int previous_follower, next_follower;
+  /* sequence number of the first message not yet delivered */
+  unsigned long cursor;
+  /* MAX_MEMBERSHIPS slots, taken on the first join, free ones have no room */
+  struct Membership * memberships;
+  struct Buffer * input;
+  struct Bucket buckets[LIMIT_CLASSES];
+  /* for a link from a peer, the peer and the number of the link */
+  struct Peer * peer;
+  unsigned long link;
+};
+
+/* Parallel tables indexed by connection, one set per worker. Slot 0 is the
+   listening socket, WAKEUP_SLOT the descriptor other workers signal when
+   they store messages. The tables grow in chunks up to
+   config.max_connections clients. Slots never move: a released one keeps a
+   negative descriptor, which poll() skips, until it is reused. Slot 0
+   doubles as the end marker of the 'free', 'closed', 'paused' and waiting
+   lists.
+
+   A connection whose backlog reaches the high watermark stops being read
+   until the backlog is back to the low one; one that stays paused for the
+   eviction timeout is closed, as is one that sends nothing for the idle
+   timeout. */
+static __thread struct {
+  struct pollfd * sockets;
+  struct ConnectionState * state;
+  struct ConnectionData * data;
   int length;
+  int capacity;
+  int free;
+  int closed;
+  int paused;
+  int throttled;
 } connections;
 
-struct Message {
-  char nick[MAX_NICK_LENGTH + 1];
-  char data[MAX_MESSAGE_LENGTH + 1];
-  struct timespec time;
+/* Kept open to be given up when the descriptors run out, so a connection
+   could still be accepted, and closed, rather than left to make the
+   listening socket ready over and over. */
+static __thread int spare_descriptor;
+
+/* Deadlines of the connections of a worker, in a hierarchical timing wheel
+   ticking every second of the monotonic clock. A slot of level l spans
+   TIMER_SLOTS^l ticks; a timer goes into the lowest level that reaches its
+   deadline and moves down a level whenever the wheel below has turned
+   around. A connection has one timer, for the earliest of its deadlines.
+   Deadlines moving later leave it alone: when it goes off, it is set again
+   for the next one. 'occupied' has a bit per slot with timers. The
+   listener, slot 0 that ends the lists, has no timer but 'listen_again',
+   the tick to watch it again at after accepting ran short, 0 when it is
+   watched. */
+static __thread struct {
+  int slots[TIMER_LEVELS][TIMER_SLOTS];
+  uint64_t occupied[TIMER_LEVELS];
+  unsigned long now;
+  unsigned long listen_again;
+} timers;
+
+/* Connections that get messages pushed. Pushing happens once per loop
+   iteration for everything stored up to then ('pushed' is the head of the
+   log at the last push). Paused subscribers are skipped and set 'lagging'
+   when they resume, so the next push visits them even with no new
+   messages. */
+static __thread struct {
+  int first;
+  int lagging;
+  unsigned long pushed;
+} subscribers;
+
+/* Connections that get roster changes pushed, the same way. */
+static __thread struct {
+  int first;
+  int lagging;
+  unsigned long pushed;
+} followers;
+
+/* The rooms with members on this worker, indexed by room number, and the
+   list of those. Pushing walks them and, in a room whose log has moved on,
+   only its members here. */
+struct LocalRoom {
+  struct Room * room;
+  /* first membership in the list of the members */
+  int first;
+  /* links in the list of rooms with members */
+  int previous, next;
+  unsigned long pushed;
+};
+
+static __thread struct {
+  struct LocalRoom * rooms;
+  int first;
+  int lagging;
+} local_rooms;
+
+/* Counters and histograms of a worker. Only the worker writes them, but
+'stats' on any worker reads them all, so they are accessed atomically,
+which costs nothing more than plain loads and stores when relaxed. A
+histogram counts values by bit length: the values in bucket b are below
+2^b, and not below 2^(b - 1). Gauges like queued_bytes go down as well,
+wrapping around in a worker but not in the sum. */
+enum {
+  COUNTER_WAKEUPS, COUNTER_ACCEPT_CALLS, COUNTER_READ_CALLS,
+  COUNTER_WRITE_CALLS, COUNTER_BYTES_IN, COUNTER_BYTES_OUT,
+  COUNTER_MESSAGES_STORED, COUNTER_COMMANDS, COUNTER_QUEUED_BYTES,
+  COUNTER_PAUSED_CONNECTIONS, COUNTER_EVICTED_CONNECTIONS,
+  COUNTER_REAPED_CONNECTIONS, COUNTER_REFUSED_CONNECTIONS,
+  COUNTER_THROTTLED_COMMANDS,
+  COUNTER_COMPRESSED_BYTES_IN, COUNTER_COMPRESSED_BYTES_OUT,
+  COUNTER_FORWARDED_MESSAGES, COUNTER_RELAYED_MESSAGES,
+  COUNTER_BUFFER_POOL_BYTES, COUNTER_FREE_SLICE_BUFFERS,
+  COUNTER_FREE_SMALL_BUFFERS, COUNTER_FREE_LARGE_BUFFERS,
+  COUNTER_FREE_INPUT_BUFFERS, COUNTERS
+};
+
+static const char * const counter_names[COUNTERS] = {
+  "wakeups", "accept_calls", "read_calls", "write_calls", "bytes_in",
+  "bytes_out", "messages_stored", "commands", "queued_bytes",
+  "paused_connections", "evicted_connections", "reaped_connections",
+  "refused_connections", "throttled_commands", "compressed_bytes_in",
+  "compressed_bytes_out", "forwarded_messages", "relayed_messages",
+  "buffer_pool_bytes",
+  "free_slice_buffers", "free_small_buffers", "free_large_buffers",
+  "free_input_buffers"
+};
+
+/* One per command in the order of the command table follows the others. */
+enum { HISTOGRAM_READY, HISTOGRAM_QUEUED, HISTOGRAM_COMMAND };
+
+#define HISTOGRAMS (HISTOGRAM_COMMAND + MAX_COMMANDS)
+
+/* those of the commands are filled in by init_stats() */
+static char histogram_names[HISTOGRAMS][MAX_STAT_NAME] = {
+  "ready_events", "output_queued_bytes"
+};
+
+struct Stats {
+  unsigned long counters[COUNTERS];
+  unsigned long histograms[HISTOGRAMS][HISTOGRAM_BUCKETS];
+};
+
+static __thread struct Stats stats;
+
+/* Nicks of the connections of all workers, for 'folks'. Each is kept
+   rendered as the line 'folks' replies with. Entry 0 is the end marker of
+   the 'free' list; the 'count' present ones are listed in 'order', so a
+   page of them is a slice of it. A leave moves the last one into the gap.
+
+   Joins and leaves, a rename being both, are kept as the lines followers
+   get, in a ring of the last ROSTER_CHANGES; 'changed' numbers the next
+   one. Entries are remote for the folks of a peer, which are not passed
+   on to the other peers; 'remote' of the 'count' are. */
+struct RosterEntry {
+  /* "nick\r\n" */
+  char line[MAX_NICK_LENGTH + 2];
+  unsigned char length;
+  unsigned char remote;
+  int next;
+  int position;
+};
+
+struct RosterChange {
+  /* "+nick\r\n" or "-nick\r\n" */
+  char line[MAX_NICK_LENGTH + 3];
+  unsigned char length;
+  unsigned char remote;
 };
 
 static struct {
-  struct Message messages[MAX_HISTORY_LENGTH];
+  pthread_mutex_t lock;
+  struct RosterEntry * entries;
+  int * order;
   int length;
-} history;
+  int capacity;
+  int count;
+  int remote;
+  int free;
+  struct RosterChange changes[ROSTER_CHANGES];
+  unsigned long changed;
+} roster;
+
+/* Messages are numbered in order of arrival and stored in blocks, one array
+   per field, laid out by lay_out_block() right after the header in the same
+   allocation. Blocks of the lobby hold HISTORY_BLOCK_LENGTH messages, those
+   of a room no more than the room keeps. Each message is rendered once,
+   as the "[hh:mm:ss] nick: text\r\n" line 'new' replies with, and packed
+   into 'bytes' right after the previous one, so consecutive messages form
+   one contiguous run. Pages of 'bytes' past the last message are never
+   touched, so short messages cost only what they use. */
+struct HistoryBlock {
+  /* one held by the ring while the block is in it, one per pending slice;
+     slices of any worker hold them, so the count is atomic */
+  int references;
+  /* sequence number of the message at position 0 */
+  unsigned long first;
+  /* link in the retired or spare list and the epoch it was retired in */
+  struct HistoryBlock * next;
+  unsigned long retired;
+  /* mapped from the journal rather than allocated */
+  int mapped;
+  /* messages it has room for, 'length' + 1 offsets */
+  unsigned long length;
+  struct timespec * time;
+  unsigned * offset;
+  unsigned char * nick_length;
+  /* set by the writer of each message once it is complete */
+  unsigned char * published;
+  /* set for a message a peer relayed, which is not relayed on */
+  unsigned char * relayed;
+  char * bytes;
+};
+
+/* A ring of blocks holding the last 'retention' of the messages below
+   'next'. Any worker appends without a lock: it reserves a sequence number
+   and the bytes for its line in one compare-and-swap on 'tail' (sequence
+   number above OFFSET_BITS, end of the reserved bytes in the block below),
+   writes the message and sets its published flag. Whoever finds the
+   message at 'next' published moves 'next' on, so readers only ever look
+   below it and take no lock either.
+
+   The ring has two blocks more than the retention needs: the one of the
+   head and the one after it. A writer reserves no further ahead than that,
+   it waits for the head to catch up otherwise, so the block it recycles
+   holds no message still being written and none retained. Times come
+   from history_time(), read after the reservation is seen, so they never
+   decrease along the sequence and can be binary searched.
+
+   The lobby is the history everybody shares, rooms have one each. */
+struct History {
+  struct HistoryBlock ** blocks;
+  unsigned long length;
+  unsigned long retention;
+  /* messages per block */
+  unsigned long block_length;
+  uint64_t tail;
+  unsigned long next;
+  /* nothing below it is kept, for a journal restored without its start */
+  unsigned long oldest;
+  /* latest message time handed out, in nanoseconds since the Epoch */
+  uint64_t clock;
+};
+
+static struct History lobby;
+
+/* Rooms are made by their first join and go with their last leave, up to
+   config.max_rooms of them at once, numbered from 1 with the numbers of
+   those gone taken again first. Each has a log of its own and the roster
+   entries of its members, in 'entries' as in roster.order, with their
+   memberships in 'members' at the same places. 'users' counts the
+   memberships and the joins on their way, under the lock of the table;
+   the room goes when it drops to 0. The lock of a room is taken after
+   that of the table and before the roster lock. */
+struct Room {
+  char name[MAX_ROOM_LENGTH + 1];
+  size_t length;
+  unsigned long hash;
+  int number;
+  int users;
+  struct History history;
+  pthread_mutex_t lock;
+  int * entries;
+  struct Membership ** members;
+  int count;
+  int capacity;
+};
+
+/* Open addressing by name, 'mask' + 1 slots, at least twice as many as
+   there can be rooms, and the numbers of the rooms gone. */
+static struct {
+  pthread_mutex_t lock;
+  struct Room ** table;
+  unsigned long mask;
+  int count;
+  int * numbers;
+  int free_numbers;
+} rooms;
+
+/* With a journal directory, a thread of its own writes the messages behind
+   the head into one file per history block, laid out like the block in
+   memory, so a restart maps the files in place of the blocks without
+   reading them. A run of messages goes out as its bytes and fields, and
+   its end offsets, which mark the messages complete, are held back until
+   a sync has made the rest durable, so a crash can lose messages but never
+   leaves a torn one. With a zero sync interval every run is synced at
+   once, batching every message stored meanwhile into one sync; a longer
+   one trades the messages of that many milliseconds for fewer syncs.
+   The files of blocks wholly behind the retention are removed whenever
+   the next one is opened. */
+static struct {
+  const char * directory;
+  long sync_interval;
+  /* file of the block starting at 'file' */
+  int fd;
+  unsigned long file;
+  /* the files of the blocks below this are gone */
+  unsigned long removed;
+  /* messages below this have been written */
+  unsigned long written;
+  /* end offsets of the 'unmarked' messages written last, not marked
+     complete yet, to go at 'marked' in the file */
+  unsigned offsets[HISTORY_BLOCK_LENGTH];
+  size_t marked;
+  unsigned long unmarked;
+  int dirty;
+  struct timespec synced;
+} journal;
+
+/* With an upgrade socket, a process started on the same socket takes over
+   from the one serving there: the workers of the old one stop and hand
+   each of their connections over with its state, the journal writer
+   writes all the messages stored, then the listening sockets go over and
+   the old process exits. Clients only see a pause. Every connection is a
+   record, with its descriptor attached, followed by its unprocessed input
+   and its pending output in chunks, as packets of a SOCK_SEQPACKET socket;
+   the listening sockets come last. Rooms only keep their members, their
+   logs are not journaled. */
+enum { UPGRADE_CONNECTION = 'c', UPGRADE_LISTENERS = 'l' };
+enum {
+  UPGRADE_BINARY = 1, UPGRADE_SUBSCRIBED = 2, UPGRADE_FOLLOWING = 4,
+  UPGRADE_COMPRESSED = 8
+};
+
+struct Adoption {
+  struct Adoption * next;
+  int fd;
+  int flags;
+  char nick[MAX_NICK_LENGTH + 1];
+  unsigned long cursor;
+  int rooms;
+  char room[MAX_MEMBERSHIPS][MAX_ROOM_LENGTH + 1];
+  /* the input, then the output */
+  size_t input, output;
+  char * bytes;
+};
+
+static struct {
+  const char * path;
+  int listener;
+  /* connection to the process taking over */
+  int fd;
+  int requested;
+  /* threads done handing over */
+  int done;
+  pthread_mutex_t lock;
+  pthread_cond_t handed_over;
+} upgrade;
+
+/* With peers, a thread per link streams them the lobby messages and the
+   roster changes of the local clients, collected in 'batch' and written
+   out at once. On the receiving end a peer is known by its name across
+   links: 'next' is the first of its messages not stored yet, 'at' the
+   number of its next relay, 'link' numbers its latest link, the only one
+   it is taken from, and 'folks' are the roster entries that link joined.
+   A replaced link may still be read on another worker, so 'next' and 'at'
+   go through atomics. The lock is taken before the roster lock. */
+struct RemoteNick {
+  int entry;
+  char nick[MAX_NICK_LENGTH + 1];
+};
+
+struct Peer {
+  char name[MAX_PEER_NAME + 1];
+  unsigned long next;
+  unsigned long at;
+  unsigned long link;
+  struct RemoteNick * folks;
+  int count;
+  int capacity;
+};
+
+struct Link {
+  const char * host;
+  const char * port;
+  struct Worker * worker;
+  int fd;
+  /* next message and roster change to go out, and the number the peer
+     gives the next relay */
+  unsigned long cursor;
+  unsigned long roster_cursor;
+  unsigned long expected;
+  char * batch;
+  size_t used;
+  size_t capacity;
+};
+
+static struct {
+  /* host:port of this server, which its peers know it by */
+  char name[MAX_PEER_NAME + 1];
+  struct Link links[MAX_PEERS];
+  int link_count;
+  /* of the hosts of the links, the only ones a link is taken from */
+  struct in_addr * addresses;
+  int address_count;
+  pthread_mutex_t lock;
+  struct Peer peers[MAX_PEERS];
+  int peer_count;
+} federation;
+
+/* A block that loses its last reference may still be looked at by workers
+   that took it out of the ring before, so it is retired first. It becomes
+   spare once every worker has passed a quiescent point, i.e. has finished
+   its loop iteration, since then. Each worker keeps the blocks it released
+   itself. */
+static __thread struct {
+  struct HistoryBlock * retired;
+  struct HistoryBlock * spare;
+  int spare_length;
+} reclaim;
+
+/* "[hh:mm:ss]" of the second this thread last stamped a message in, as
+   rendering it takes localtime_r, which may take a lock and look at the
+   time zone file. */
+static __thread struct {
+  time_t second;
+  char rendered[TIMESTAMP_LENGTH + 1];
+} stamp;
+
+/* bumped whenever a block of any history is retired */
+static unsigned long retirement_epoch;
+
+struct ReadyEvent {
+  int client;
+  short events;
+};
+
+static __thread struct {
+#ifdef USE_EPOLL
+  int fd;
+  struct epoll_event events[READY_BATCH];
+#endif
+#ifdef USE_IO_URING
+  int fd;
+  unsigned * sq_head, * sq_tail, * sq_mask, * sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe * sqes;
+  unsigned * cq_head, * cq_tail, * cq_mask;
+  struct io_uring_cqe * cqes;
+  unsigned to_submit;
+  int timer_armed;
+  struct __kernel_timespec timeout;
+  uint64_t next_tag;
+  /* user_data of the poll request currently armed for each connection */
+  uint64_t * armed;
+#endif
+  struct ReadyEvent ready[READY_BATCH];
+} loop;
+
+/* A thread with a listening socket, a connection table and an event loop
+   of its own. A worker about to sleep with subscribers sets 'wanted'; the
+   first worker that stores messages after that clears it and writes to
+   'wakeup', so idle workers are only signaled when they have something to
+   push. */
+struct Worker {
+  pthread_t thread;
+  int listener;
+  /* read and write ends, the same eventfd where there is one */
+  int wakeup[2];
+  int wanted;
+  /* set when this worker stored messages or changed the roster during the
+     current iteration */
+  int appended;
+  /* history epoch at the start of the current iteration, EPOCH_OFFLINE
+     while the worker sleeps */
+  unsigned long epoch;
+  /* set once the thread runs */
+  struct Stats * stats;
+  /* connections taken over from the process before, for this worker to
+     serve */
+  struct Adoption * adopted;
+};
+
+static struct Worker * workers;
+static __thread struct Worker * worker;
 
 static void
 die(const char * fmt, ...) {
@@ -103,309 +994,4516 @@ die(const char * fmt, ...) {
 static char *
 system_error(void) { return strerror(errno); }
 
+/* The coarse clock is good enough for stamping messages and pacing the
+   journal, and costs no more than a memory read. */
 static struct timespec
 get_time(void) {
   struct timespec time;
-  if (-1 == clock_gettime(CLOCK_REALTIME, &time)) {
+  if (-1 == clock_gettime(CLOCK_REALTIME_COARSE, &time)) {
     die("'clock_gettime' failed: %s", system_error());
   }
   return time;
 }
 
 static void
-show_usage(char * program) { die("usage: %s <port>", program); }
+count(int counter, unsigned long n) {
+  __atomic_store_n(&stats.counters[counter], stats.counters[counter] + n,
+    __ATOMIC_RELAXED);
+}
 
 static void
-prepare_server(uint16_t port) {
-  int error, t;
-  static struct sockaddr_in server;
-  int server_fd;
-  server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-  if (-1 == server_fd) die("'socket' failed: %s", system_error());
-  server.sin_family = AF_INET;
-  server.sin_port = htons(port);
-  server.sin_addr.s_addr = htonl(INADDR_ANY);
-  t = 1;
-  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t));
-  error = bind(server_fd, (struct sockaddr *) &server, sizeof(server));
-  if (-1 == error) die("'bind' failed: %s", system_error());
-  error = listen(server_fd, 128);
-  if (-1 == error) die("'listen' failed: %s", system_error());
-  connections.sockets[0].fd = server_fd;
-  connections.sockets[0].events = POLLIN;
-  connections.length = 1;
+record(int histogram, unsigned long value) {
+  unsigned long * bucket;
+  int bits;
+  for (bits = 0; bits < (int) HISTOGRAM_BUCKETS - 1 && value >> bits; ++bits) {
+  }
+  bucket = &stats.histograms[histogram][bits];
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
 }
 
-static struct LinkedBuffer *
-take_buffer(void) {
-  struct LinkedBuffer * buffer;
-  buffer = first_free_buffer;
-  if (!buffer) die("Memory limit exceeded");
-  first_free_buffer = first_free_buffer->next;
-  buffer->buffer.used = 0;
-  buffer->next = NULL;
-  return buffer;
-}
+#ifdef USE_POLL
 
 static void
-release_buffer(struct LinkedBuffer * buffer) {
-  buffer->next = first_free_buffer;
-  first_free_buffer = buffer;
-}
+loop_init(void) { }
 
 static void
-send_later(int client, char * message) {
-  struct ListOfBuffers * pending;
-  struct Buffer * buffer;
-  size_t size, stored, part_size;
-  size = strlen(message);
-  pending = &connections.data[client].pending_to_be_sent;
-  if (!pending->last) {
-    pending->last = pending->first = take_buffer();
-  } else if (pending->last->buffer.used == sizeof(pending->last->buffer.data)) {
-    pending->last->next = take_buffer();
-    pending->last = pending->last->next;
+loop_grow(void) { }
+
+static void
+watch(int client) { (void) client; }
+
+static void
+unwatch(int client) { (void) client; }
+
+static void
+update_watch(int client) { (void) client; }
+
+static int
+wait_for_events(int timeout) {
+  int i, n;
+  short events;
+  if (-1 == poll(connections.sockets, connections.length, timeout)) {
+    if (EINTR == errno) return 0;
+    die("'poll' failed: %s", system_error());
   }
-  stored = 0;
-  while (stored < size) {
-    if (stored) {
-      pending->last->next = take_buffer();
-      pending->last = pending->last->next;
-    }
-    buffer = &pending->last->buffer;
-    part_size = MIN(sizeof(buffer->data) - buffer->used, size - stored);
-    memcpy(buffer->data + buffer->used, message + stored, part_size);
-    buffer->used += part_size;
-    stored += part_size;
+  /* Sockets left over once the batch is full are level-triggered and get
+     reported again by the next poll. */
+  for (i = n = 0; i < connections.length && n < READY_BATCH; ++i) {
+    events = connections.sockets[i].revents;
+    if (!events) continue;
+    loop.ready[n].client = i;
+    loop.ready[n].events = events;
+    ++n;
   }
-  connections.sockets[client].events = POLLOUT;
+  return n;
 }
 
-static void
-send_package(int client, char * message) {
-  send_later(client, message);
-  send_later(client, "\r\n");
+#endif
+
+#ifdef USE_EPOLL
+
+static uint32_t
+to_epoll(short events) {
+  uint32_t result = EPOLLET;
+  if (events & POLLIN) result |= EPOLLIN;
+  if (events & POLLOUT) result |= EPOLLOUT;
+  return result;
 }
 
-static int
-starts_with(char * string, const char * start) {
-  return !strncmp(string, start, strlen(start));
+static short
+from_epoll(uint32_t events) {
+  short result = 0;
+  if (events & EPOLLIN) result |= POLLIN;
+  if (events & EPOLLOUT) result |= POLLOUT;
+  if (events & EPOLLERR) result |= POLLERR;
+  if (events & EPOLLHUP) result |= POLLHUP;
+  return result;
 }
 
 static void
-add_to_history(char * nick, char * message) {
-  struct timespec now;
-  now = get_time();
-  memmove(history.messages + 1, history.messages,
-    history.length * sizeof(history.messages[0]));
-  strcpy(history.messages[0].nick, nick);
-  strcpy(history.messages[0].data, message);
-  history.messages[0].time = now;
-  if (history.length < MAX_HISTORY_LENGTH) ++history.length;
+loop_init(void) {
+  loop.fd = epoll_create1(0);
+  if (-1 == loop.fd) die("'epoll_create1' failed: %s", system_error());
 }
 
-#define PACKAGE_BEGIN_MY_NAME_IS "my name is "
-#define PACKAGE_BEGIN_SEND "send "
-#define PACKAGE_FOLKS "folks"
-#define PACKAGE_NEW "new"
+static void
+loop_grow(void) { }
 
-static int
-older(struct timespec a, struct timespec b) {
-  return a.tv_sec < b.tv_sec ||
-    (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+static void
+control(int operation, int client) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = to_epoll(connections.sockets[client].events);
+  event.data.u64 = (uint64_t) connections.state[client].generation << 32 |
+    client;
+  if (-1 == epoll_ctl(loop.fd, operation, connections.sockets[client].fd,
+      &event)) {
+    die("'epoll_ctl' failed: %s", system_error());
+  }
 }
 
+static void
+watch(int client) { control(EPOLL_CTL_ADD, client); }
+
+/* Closing the descriptor drops it from the epoll set. */
+static void
+unwatch(int client) { (void) client; }
+
+static void
+update_watch(int client) { control(EPOLL_CTL_MOD, client); }
+
 static int
-process_new_package(int client, char * package) {
-  int length, i;
-  char outgoing[MAX_PACKAGE_LENGTH];
-  struct timespec last_received_message, time;
-  struct tm pretty_time;
-  if (starts_with(package, PACKAGE_BEGIN_MY_NAME_IS)) {
-    length = strlen(package + strlen(PACKAGE_BEGIN_MY_NAME_IS));
-    if (MAX_NICK_LENGTH < length) goto close_connection;
-    strcpy(connections.data[client].nick,
-      package + strlen(PACKAGE_BEGIN_MY_NAME_IS));
-  } else if (!strcmp(package, PACKAGE_FOLKS)) {
-    sprintf(outgoing, "%d", connections.length - 1);
-    send_package(client, outgoing);
-    for (i = 1; i < connections.length; ++i) {
-      send_package(client, connections.data[i].nick);
-    }
-  } else if (starts_with(package, PACKAGE_BEGIN_SEND)) {
-    length = strlen(package + strlen(PACKAGE_BEGIN_SEND));
-    if (MAX_MESSAGE_LENGTH < length) return -1;
-    add_to_history(connections.data[client].nick,
-      package + strlen(PACKAGE_BEGIN_SEND));
-  } else if (!strcmp(package, PACKAGE_NEW)) {
-    last_received_message = connections.data[client].last_received_message;
-    i = history.length - 1;
-    while (older(history.messages[i].time, last_received_message) && i >= 0) {
-      --i;
-    }
-    sprintf(outgoing, "%d", i + 1);
-    send_package(client, outgoing);
-    while (i >= 0) {
-      time = history.messages[i].time;
-      if (!localtime_r(&time.tv_sec, &pretty_time)) {
-        goto close_connection;
-      }
-      sprintf(outgoing, "[%02d:%02d:%02d] %s: %s",
-        pretty_time.tm_hour, pretty_time.tm_min, pretty_time.tm_sec,
-        history.messages[i].nick, history.messages[i].data);
-      send_package(client, outgoing);
-      --i;
+wait_for_events(int timeout) {
+  int i, j, n, client;
+  n = epoll_wait(loop.fd, loop.events, READY_BATCH, timeout);
+  if (-1 == n) {
+    if (EINTR == errno) return 0;
+    die("'epoll_wait' failed: %s", system_error());
+  }
+  for (i = j = 0; i < n; ++i) {
+    client = loop.events[i].data.u64 & 0xffffffffUL;
+    if (loop.events[i].data.u64 >> 32 !=
+        connections.state[client].generation) {
+      continue;
     }
-    connections.data[client].last_received_message = get_time();
-  } else goto close_connection;
-  return 0;
-close_connection:
-  close(connections.sockets[client].fd);
-  return -1;
+    loop.ready[j].client = client;
+    loop.ready[j].events = from_epoll(loop.events[i].events);
+    ++j;
+  }
+  return j;
 }
 
+#endif
+
+#ifdef USE_IO_URING
+
+/* Polls are one-shot: a completion disarms the connection and the wait that
+   reaps it queues the re-arm right away. The queued request only reaches the
+   kernel with the next io_uring_enter, i.e. after the handlers have drained
+   the socket. Every armed poll carries a fresh tag in its user_data so
+   completions of cancelled polls are recognized and dropped. */
+
 static int
-process_new_data(int client) {
-  struct Buffer * buffer;
-  char * begin, * end_of_package;
-  buffer = &connections.data[client].input_buffer;
-  begin = buffer->data;
-  while (1) {
-    end_of_package = strstr(begin, "\r\n");
-    if (!end_of_package && begin == buffer->data &&
-        sizeof(buffer->data) - 1 == buffer->used) {
-      close(connections.sockets[client].fd);
-      return -1;
+uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(SYS_io_uring_enter, loop.fd, to_submit, min_complete,
+    flags, NULL, 0);
+}
+
+static void
+uring_submit(void) {
+  int submitted;
+  while (loop.to_submit) {
+    submitted = uring_enter(loop.to_submit, 0, 0);
+    if (-1 == submitted) {
+      if (EINTR == errno) continue;
+      die("'io_uring_enter' failed: %s", system_error());
     }
-    if (!end_of_package) break;
-    *end_of_package = '\0';
-    if (-1 == process_new_package(client, begin)) return -1;
-    begin = end_of_package + 2;
+    loop.to_submit -= submitted;
   }
-  buffer->used -= begin - buffer->data;
-  memmove(buffer->data, begin, buffer->used);
-  return 0;
+}
+
+static struct io_uring_sqe *
+uring_sqe(void) {
+  unsigned tail;
+  struct io_uring_sqe * sqe;
+  tail = *loop.sq_tail;
+  if (tail - __atomic_load_n(loop.sq_head, __ATOMIC_ACQUIRE) ==
+      loop.sq_entries) {
+    uring_submit();
+  }
+  sqe = &loop.sqes[tail & *loop.sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
 }
 
 static void
-handle_input(int client) {
-  struct Buffer * buffer;
-  int fd;
-  ssize_t received;
-  fd = connections.sockets[client].fd;
-  buffer = &connections.data[client].input_buffer;
-  received = recv(fd, buffer->data + buffer->used,
-    sizeof(buffer->data) - buffer->used - 1, 0);
-  if (!received || -1 == received) goto close_connection;
-  buffer->used += received;
-  buffer->data[buffer->used] = '\0';
-  if (-1 == process_new_data(client)) goto close_connection;
-  return;
-close_connection:
-  connections.data[client].closed = 1;
+uring_push(struct io_uring_sqe * sqe) {
+  unsigned tail;
+  tail = *loop.sq_tail;
+  loop.sq_array[tail & *loop.sq_mask] = sqe - loop.sqes;
+  __atomic_store_n(loop.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++loop.to_submit;
 }
 
 static void
-handle_output(int client) {
-  struct LinkedBuffer * buffer;
-  struct ListOfBuffers * pending;
-  int fd;
-  ssize_t sent;
-  pending = &connections.data[client].pending_to_be_sent;
-  fd = connections.sockets[client].fd;
-  assert(pending->first);
-  while (1) {
-    buffer = pending->first;
-    sent = send(fd, buffer->buffer.data, buffer->buffer.used, 0);
-    if (-1 == sent) {
-      if (EWOULDBLOCK == errno || EAGAIN == errno) return;
-      die("'send' failed: %s", system_error());
-    }
-    assert(sent == buffer->buffer.used);
-    pending->first = buffer->next;
-    release_buffer(buffer);
-    if (!pending->first) {
-      pending->last = NULL;
-      break;
-    }
+loop_init(void) {
+  struct io_uring_params params;
+  char * sq, * cq;
+  size_t sq_size, cq_size;
+  memset(&params, 0, sizeof(params));
+  loop.fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+  if (-1 == loop.fd) die("'io_uring_setup' failed: %s", system_error());
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size = cq_size = sq_size < cq_size ? cq_size : sq_size;
   }
-  connections.sockets[client].events = POLLIN;
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    loop.fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == sq) die("'mmap' failed: %s", system_error());
+  cq = sq;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, loop.fd, IORING_OFF_CQ_RING);
+    if (MAP_FAILED == cq) die("'mmap' failed: %s", system_error());
+  }
+  loop.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop.fd,
+    IORING_OFF_SQES);
+  if (MAP_FAILED == loop.sqes) die("'mmap' failed: %s", system_error());
+  loop.sq_head = (unsigned *) (sq + params.sq_off.head);
+  loop.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  loop.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  loop.sq_array = (unsigned *) (sq + params.sq_off.array);
+  loop.sq_entries = params.sq_entries;
+  loop.cq_head = (unsigned *) (cq + params.cq_off.head);
+  loop.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  loop.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  loop.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
 }
 
 static void
-init() {
-  int i, n;
-  for (i = 0, n = sizeof(free_buffers) / sizeof(free_buffers[0]) - 1;
-      i < n; ++i) {
-    free_buffers[i].next = &free_buffers[i + 1];
-  }
-  first_free_buffer = &free_buffers[0];
+loop_grow(void) {
+  uint64_t * armed;
+  armed = realloc(loop.armed, connections.capacity * sizeof(*armed));
+  if (!armed) die("Out of memory");
+  memset(armed + connections.length, 0,
+    (connections.capacity - connections.length) * sizeof(*armed));
+  loop.armed = armed;
 }
 
 static void
-accept_new_client(void) {
-  struct sockaddr_in address;
-  socklen_t address_length;
-  int client_fd, n;
-  address_length = sizeof(address);
-  client_fd = accept(connections.sockets[0].fd,
-    (struct sockaddr *) &address, &address_length);
-  if (client_fd < 0) die("'accept' failed: %s", system_error());
-  n = connections.length;
-  if (n == MAX_CONNECTIONS) {
-    close(client_fd);
-    return;
-  }
-  connections.sockets[n].fd = client_fd;
-  connections.sockets[n].events = POLLIN;
-  memset(&connections.data[n], 0, sizeof(connections.data[n]));
-  strcpy(connections.data[n].nick, "anonym");
-  connections.data[n].last_received_message = get_time();
-  ++connections.length;
+arm(int client) {
+  struct io_uring_sqe * sqe;
+  sqe = uring_sqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = connections.sockets[client].fd;
+  sqe->poll32_events = connections.sockets[client].events;
+  loop.armed[client] = (++loop.next_tag << 32) | client;
+  sqe->user_data = loop.armed[client];
+  uring_push(sqe);
 }
 
 static void
-clean_closed_sockets(void) {
-  int s, d;
-  for (s = d = 0; s < connections.length; ++s) {
-    if (connections.data[s].closed) continue;
-    connections.sockets[d] = connections.sockets[s];
-    connections.data[d] = connections.data[s];
-    ++d;
-  }
-  connections.length = d;
+disarm(int client) {
+  struct io_uring_sqe * sqe;
+  if (!loop.armed[client]) return;
+  sqe = uring_sqe();
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->addr = loop.armed[client];
+  uring_push(sqe);
+  loop.armed[client] = 0;
 }
 
-int
-main(int argc, char * argv[]) {
-  int i, n;
+static void
+watch(int client) { arm(client); }
+
+static void
+unwatch(int client) {
+  disarm(client);
+  uring_submit();
+}
+
+static void
+update_watch(int client) {
+  if (!loop.armed[client]) return;
+  disarm(client);
+  arm(client);
+}
+
+/* A wait with a timeout keeps one timeout request in flight; its
+   completion carries URING_TIMER_TAG. */
+static void
+arm_timer(int timeout) {
+  struct io_uring_sqe * sqe;
+  if (loop.timer_armed) return;
+  loop.timeout.tv_sec = timeout / 1000;
+  loop.timeout.tv_nsec = timeout % 1000 * 1000000L;
+  sqe = uring_sqe();
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (unsigned long) &loop.timeout;
+  sqe->len = 1;
+  sqe->user_data = URING_TIMER_TAG;
+  uring_push(sqe);
+  loop.timer_armed = 1;
+}
+
+static int
+wait_for_events(int timeout) {
+  unsigned head, tail;
+  struct io_uring_cqe * cqe;
+  int client, n;
+  if (timeout >= 0) arm_timer(timeout);
+  if (-1 == uring_enter(loop.to_submit, 1, IORING_ENTER_GETEVENTS)) {
+    if (EINTR == errno) return 0;
+    die("'io_uring_enter' failed: %s", system_error());
+  }
+  loop.to_submit = 0;
+  n = 0;
+  head = *loop.cq_head;
+  tail = __atomic_load_n(loop.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail && n < READY_BATCH; ++head) {
+    cqe = &loop.cqes[head & *loop.cq_mask];
+    if (URING_TIMER_TAG == cqe->user_data) {
+      loop.timer_armed = 0;
+      continue;
+    }
+    client = cqe->user_data & 0xffffffffUL;
+    if (!cqe->user_data || cqe->user_data != loop.armed[client]) continue;
+    loop.armed[client] = 0;
+    if (cqe->res < 0) {
+      if (-ECANCELED == cqe->res) continue;
+      loop.ready[n].events = POLLERR;
+    } else {
+      loop.ready[n].events = cqe->res;
+    }
+    loop.ready[n].client = client;
+    ++n;
+    arm(client);
+  }
+  __atomic_store_n(loop.cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+#endif
+
+static void
+set_events(int client, short events) {
+  if (connections.sockets[client].events == events) return;
+  connections.sockets[client].events = events;
+  update_watch(client);
+}
+
+/* Input is wanted unless the connection is held back, output whenever
+   something is pending. */
+static void
+update_interest(int client) {
+  struct ConnectionState * state;
+  short events;
+  state = &connections.state[client];
+  events = 0;
+  if (!state->waiting && !state->paused && !state->throttled) {
+    events |= POLLIN;
+  }
+  if (state->pending_to_be_sent.first) events |= POLLOUT;
+  set_events(client, events);
+}
+
+static unsigned long
+monotonic_milliseconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000UL + now.tv_nsec / 1000000;
+}
+
+/* Puts the timer in the slot for 'deadline', which must not be before the
+   current tick. Beyond the reach of the wheel it goes off early. */
+static void
+link_timer(int client, unsigned long deadline) {
+  struct ConnectionState * state;
+  unsigned long ticks;
+  int level, slot;
+  ticks = deadline - timers.now;
+  if (ticks >> TIMER_BITS * TIMER_LEVELS) {
+    ticks = (1UL << TIMER_BITS * TIMER_LEVELS) - 1;
+    deadline = timers.now + ticks;
+  }
+  for (level = 0; ticks >> TIMER_BITS * (level + 1); ++level) { }
+  slot = deadline >> TIMER_BITS * level & (TIMER_SLOTS - 1);
+  state = &connections.state[client];
+  state->timed = 1;
+  state->timer_level = level;
+  state->deadline = deadline;
+  state->previous_timer = 0;
+  state->next_timer = timers.slots[level][slot];
+  if (state->next_timer) {
+    connections.state[state->next_timer].previous_timer = client;
+  }
+  timers.slots[level][slot] = client;
+  timers.occupied[level] |= (uint64_t) 1 << slot;
+}
+
+static void
+cancel_timer(int client) {
+  struct ConnectionState * state;
+  int slot;
+  state = &connections.state[client];
+  if (!state->timed) return;
+  state->timed = 0;
+  slot = state->deadline >> TIMER_BITS * state->timer_level &
+    (TIMER_SLOTS - 1);
+  if (state->previous_timer) {
+    connections.state[state->previous_timer].next_timer = state->next_timer;
+  } else {
+    timers.slots[state->timer_level][slot] = state->next_timer;
+    if (!state->next_timer) {
+      timers.occupied[state->timer_level] &= ~((uint64_t) 1 << slot);
+    }
+  }
+  if (state->next_timer) {
+    connections.state[state->next_timer].previous_timer =
+      state->previous_timer;
+  }
+}
+
+/* Sets the timer to go off at 'deadline', or at the next tick when that
+   has passed, unless it is set to go off before. */
+static void
+set_timer(int client, unsigned long deadline) {
+  struct ConnectionState * state;
+  state = &connections.state[client];
+  if (deadline <= timers.now) deadline = timers.now + 1;
+  if (state->timed && state->deadline <= deadline) return;
+  cancel_timer(client);
+  link_timer(client, deadline);
+}
+
+/* Takes the timers out of a slot. */
+static int
+empty_timer_slot(int level, int slot) {
+  int first;
+  first = timers.slots[level][slot];
+  timers.slots[level][slot] = 0;
+  timers.occupied[level] &= ~((uint64_t) 1 << slot);
+  return first;
+}
+
+/* Milliseconds to the next tick at which timers go off or move down, or
+   the listener is watched again, -1 when there are none. */
+static int
+timer_timeout(void) {
+  uint64_t due;
+  unsigned long ticks, now;
+  int level, shift;
+  ticks = 0;
+  for (level = 1; level < TIMER_LEVELS; ++level) {
+    if (timers.occupied[level]) {
+      ticks = TIMER_SLOTS - (timers.now & (TIMER_SLOTS - 1));
+      break;
+    }
+  }
+  shift = (timers.now + 1) & (TIMER_SLOTS - 1);
+  due = timers.occupied[0];
+  if (shift) due = due >> shift | due << (TIMER_SLOTS - shift);
+  if (due && (!ticks || (unsigned long) __builtin_ctzll(due) + 1 < ticks)) {
+    ticks = __builtin_ctzll(due) + 1;
+  }
+  if (timers.listen_again &&
+      (!ticks || timers.listen_again - timers.now < ticks)) {
+    ticks = timers.listen_again - timers.now;
+  }
+  if (!ticks) return -1;
+  now = monotonic_milliseconds();
+  if ((timers.now + ticks) * 1000 <= now) return 0;
+  return MIN((timers.now + ticks) * 1000 - now, INT_MAX);
+}
+
+static void
+pause_connection(int client) {
+  struct ConnectionState * state;
+  state = &connections.state[client];
+  state->paused = 1;
+  state->paused_since = timers.now;
+  set_timer(client, timers.now + config.eviction_timeout + 1);
+  state->previous_paused = 0;
+  state->next_paused = connections.paused;
+  if (connections.paused) {
+    connections.state[connections.paused].previous_paused = client;
+  }
+  connections.paused = client;
+  count(COUNTER_PAUSED_CONNECTIONS, 1);
+  update_interest(client);
+}
+
+static void
+unlink_paused(int client) {
+  struct ConnectionState * state;
+  state = &connections.state[client];
+  state->paused = 0;
+  if (state->previous_paused) {
+    connections.state[state->previous_paused].next_paused = state->next_paused;
+  } else {
+    connections.paused = state->next_paused;
+  }
+  if (state->next_paused) {
+    connections.state[state->next_paused].previous_paused =
+      state->previous_paused;
+  }
+  count(COUNTER_PAUSED_CONNECTIONS, -1);
+}
+
+static void
+unpause_connection(int client) {
+  unlink_paused(client);
+  update_interest(client);
+  if (connections.state[client].subscribed) subscribers.lagging = 1;
+  if (connections.state[client].following) followers.lagging = 1;
+  if (connections.data[client].memberships) local_rooms.lagging = 1;
+}
+
+/* Takes a token from the bucket of a class for a command, -1 when it is
+   empty. A bucket starts full, counts the tokens taken and gets 'rate' of
+   them back a tick, up to 'burst'. */
+static int
+take_token(int client, int class) {
+  const struct Limit * limit;
+  struct Bucket * bucket;
+  unsigned long ticks;
+  limit = &config.limits[class];
+  if (!limit->rate) return 0;
+  bucket = &connections.data[client].buckets[class];
+  ticks = timers.now - bucket->filled;
+  bucket->filled = timers.now;
+  bucket->taken = ticks >= bucket->taken ? 0
+    : bucket->taken - MIN(bucket->taken, ticks * limit->rate);
+  if (bucket->taken == limit->burst) return -1;
+  ++bucket->taken;
+  return 0;
+}
+
+/* Stops reading a connection until the next tick, when its timer puts it
+   on the throttled list. */
+static void
+throttle(int client) {
+  connections.state[client].throttled = 1;
+  set_timer(client, timers.now + 1);
+  update_interest(client);
+  count(COUNTER_THROTTLED_COMMANDS, 1);
+}
+
+static void
+show_usage(char * program) {
+  die("usage: %s [-a max_remote_folks] [-b buffer_memory] "
+    "[-c max_connections] [-e eviction_timeout] "
+    "[-f config_file] [-i idle_timeout] [-j journal_directory] "
+    "[-l room_history_length] [-m history_length] [-n max_rooms] "
+    "[-o socket_option,...] [-p host:port,...] [-q class=rate[:burst],...] "
+    "[-r input_buffer] [-s sync_interval] [-t workers] [-u upgrade_socket] "
+    "[-w high_watermark:low_watermark] [<port>]", program);
+}
+
+static void *
+grow(void * array, size_t size) {
+  array = realloc(array, size);
+  if (!array) die("Out of memory");
+  return array;
+}
+
+/* Every client needs a descriptor, so lift the soft limit as far as the
+   hard one allows for the configured number of connections. Each worker
+   needs a few more for its listener, wakeup and event loop. */
+static void
+raise_descriptor_limit(void) {
+  struct rlimit limit;
+  rlim_t wanted;
+  if (-1 == getrlimit(RLIMIT_NOFILE, &limit)) return;
+  wanted = config.max_connections + RESERVED_DESCRIPTORS + 4 * config.workers;
+  if (limit.rlim_cur >= wanted) return;
+  limit.rlim_cur = limit.rlim_max < wanted ? limit.rlim_max : wanted;
+  setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+static void
+grow_connections(void) {
+  int capacity;
+  if (connections.length < connections.capacity) return;
+  capacity = connections.capacity + CONNECTIONS_CHUNK;
+  if (capacity < connections.capacity * 2) capacity = connections.capacity * 2;
+  if (capacity > config.max_connections + FIRST_CLIENT) {
+    capacity = config.max_connections + FIRST_CLIENT;
+  }
+  connections.sockets = grow(connections.sockets,
+    capacity * sizeof(connections.sockets[0]));
+  connections.state = grow(connections.state,
+    capacity * sizeof(connections.state[0]));
+  connections.data = grow(connections.data,
+    capacity * sizeof(connections.data[0]));
+  connections.capacity = capacity;
+  loop_grow();
+}
+
+static void
+init_roster(void) {
+  pthread_mutex_init(&roster.lock, NULL);
+  roster.length = 1;
+}
+
+static unsigned long
+roster_head(void) {
+  return __atomic_load_n(&roster.changed, __ATOMIC_SEQ_CST);
+}
+
+/* With the lock held. */
+static void
+record_roster_change(char sign, struct RosterEntry * entry) {
+  struct RosterChange * change;
+  change = &roster.changes[roster.changed % ROSTER_CHANGES];
+  change->line[0] = sign;
+  memcpy(change->line + 1, entry->line, entry->length + 2);
+  change->length = entry->length;
+  change->remote = entry->remote;
+  __atomic_store_n(&roster.changed, roster.changed + 1, __ATOMIC_SEQ_CST);
+  worker->appended = 1;
+}
+
+static void
+set_roster_nick(struct RosterEntry * entry, const char * nick) {
+  entry->length = strlen(nick);
+  memcpy(entry->line, nick, entry->length);
+  memcpy(entry->line + entry->length, "\r\n", 2);
+}
+
+/* Takes a roster entry for a new connection, unless all the workers
+   together serve config.max_connections of them already, or for one of
+   the folks of a peer, unless config.max_remote_folks are listed. */
+static int
+join_roster(const char * nick, int remote) {
+  struct RosterEntry * entry;
+  int n;
+  pthread_mutex_lock(&roster.lock);
+  n = -1;
+  if (remote ? roster.remote == config.max_remote_folks
+      : roster.count - roster.remote == config.max_connections) {
+    goto unlock;
+  }
+  n = roster.free;
+  if (n) {
+    roster.free = roster.entries[n].next;
+  } else {
+    if (roster.length >= roster.capacity) {
+      roster.capacity = roster.capacity ? roster.capacity * 2
+        : CONNECTIONS_CHUNK;
+      roster.entries = grow(roster.entries,
+        roster.capacity * sizeof(roster.entries[0]));
+      roster.order = grow(roster.order,
+        roster.capacity * sizeof(roster.order[0]));
+    }
+    n = roster.length++;
+  }
+  entry = &roster.entries[n];
+  set_roster_nick(entry, nick);
+  entry->remote = remote;
+  entry->position = roster.count;
+  roster.order[roster.count++] = n;
+  roster.remote += remote;
+  record_roster_change('+', entry);
+unlock:
+  pthread_mutex_unlock(&roster.lock);
+  return n;
+}
+
+static void
+rename_in_roster(int n, const char * nick) {
+  struct RosterEntry * entry;
+  pthread_mutex_lock(&roster.lock);
+  entry = &roster.entries[n];
+  record_roster_change('-', entry);
+  set_roster_nick(entry, nick);
+  record_roster_change('+', entry);
+  pthread_mutex_unlock(&roster.lock);
+}
+
+static void
+leave_roster(int n) {
+  struct RosterEntry * entry;
+  int last;
+  pthread_mutex_lock(&roster.lock);
+  entry = &roster.entries[n];
+  record_roster_change('-', entry);
+  roster.remote -= entry->remote;
+  last = roster.order[--roster.count];
+  roster.order[entry->position] = last;
+  roster.entries[last].position = entry->position;
+  entry->next = roster.free;
+  roster.free = n;
+  pthread_mutex_unlock(&roster.lock);
+}
+
+static int
+take_slot(void) {
+  int slot;
+  slot = connections.free;
+  if (slot) {
+    connections.free = connections.state[slot].next;
+    return slot;
+  }
+  grow_connections();
+  return connections.length++;
+}
+
+static void
+close_connection(int client) {
+  struct ConnectionState * state;
+  state = &connections.state[client];
+  if (state->closed) return;
+  state->closed = 1;
+  state->next = connections.closed;
+  connections.closed = client;
+}
+
+/* Closes a connection paused for the eviction timeout or idle for the idle
+   one, or sets its timer for when it will be. Ticks are whole seconds, so
+   the timeouts run out a tick late rather than early. */
+static void
+expire_timer(int client) {
+  struct ConnectionState * state;
+  unsigned long deadline;
+  state = &connections.state[client];
+  if (state->closed) return;
+  /* set off by throttle(), the connection goes on after the timers */
+  if (state->throttled) {
+    state->next_throttled = connections.throttled;
+    connections.throttled = client;
+  }
+  deadline = ULONG_MAX;
+  if (state->paused) {
+    deadline = state->paused_since + config.eviction_timeout + 1;
+  }
+  /* a link from a peer is quiet while there is nothing to relay */
+  if (config.idle_timeout && !connections.data[client].peer) {
+    deadline = MIN(deadline, state->active + config.idle_timeout + 1);
+  }
+  if (ULONG_MAX == deadline) return;
+  if (deadline > timers.now) {
+    link_timer(client, deadline);
+    return;
+  }
+  close_connection(client);
+  count(state->paused ? COUNTER_EVICTED_CONNECTIONS
+    : COUNTER_REAPED_CONNECTIONS, 1);
+}
+
+/* Turns the wheel to the current second. At each tick the slots of the
+   levels above whose turn has come are moved down, from the top, then the
+   timers due go off. */
+static void
+run_timers(void) {
+  unsigned long now;
+  int level, client, next;
+  now = monotonic_milliseconds() / 1000;
+  while (timers.now < now) {
+    ++timers.now;
+    for (level = 0; level < TIMER_LEVELS && !timers.occupied[level]; ++level) {
+    }
+    if (TIMER_LEVELS == level) {
+      timers.now = now;
+      break;
+    }
+    for (level = 1; level < TIMER_LEVELS &&
+        !(timers.now & ((1UL << TIMER_BITS * level) - 1)); ++level) {
+    }
+    while (--level) {
+      client = empty_timer_slot(level,
+        timers.now >> TIMER_BITS * level & (TIMER_SLOTS - 1));
+      for (; client; client = next) {
+        next = connections.state[client].next_timer;
+        link_timer(client, connections.state[client].deadline);
+      }
+    }
+    client = empty_timer_slot(0, timers.now & (TIMER_SLOTS - 1));
+    for (; client; client = next) {
+      next = connections.state[client].next_timer;
+      connections.state[client].timed = 0;
+      expire_timer(client);
+    }
+  }
+  /* an edge-triggered listener reports the connections queued meanwhile
+     once it is watched again */
+  if (timers.listen_again && timers.listen_again <= timers.now) {
+    timers.listen_again = 0;
+    set_events(0, POLLIN);
+  }
+}
+
+/* Parses a comma separated list of name=value. */
+static int
+parse_socket_options(char * list) {
+  char * name, * value, * end;
+  size_t i, length, name_length;
+  long number;
+  for (name = list; *name; name += length + !!name[length]) {
+    length = strcspn(name, ",");
+    value = memchr(name, '=', length);
+    name_length = value ? (size_t) (value - name) : length;
+    for (i = 0; i < SOCKET_OPTIONS; ++i) {
+      if (name_length == strlen(socket_options[i].name) &&
+          !memcmp(name, socket_options[i].name, name_length)) {
+        break;
+      }
+    }
+    if (SOCKET_OPTIONS == i) return -1;
+    number = 1;
+    if (value) {
+      number = strtol(value + 1, &end, 10);
+      if (end == value + 1 || end != name + length || number < 0 ||
+          INT_MAX < number) {
+        return -1;
+      }
+    }
+    *socket_options[i].value = number;
+  }
+  return 0;
+}
+
+/* Adds the addresses of the host of a link to those links are taken
+   from. */
+static void
+resolve_peer(struct Link * link) {
+  struct addrinfo hints, * addresses, * address;
+  int error;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  error = getaddrinfo(link->host, NULL, &hints, &addresses);
+  if (error) die("can't resolve %s: %s", link->host, gai_strerror(error));
+  for (address = addresses; address; address = address->ai_next) {
+    federation.addresses = grow(federation.addresses,
+      (federation.address_count + 1) * sizeof(federation.addresses[0]));
+    federation.addresses[federation.address_count++] =
+      ((struct sockaddr_in *) address->ai_addr)->sin_addr;
+  }
+  freeaddrinfo(addresses);
+}
+
+static void
+init_federation(unsigned long port) {
+  int i;
+  pthread_mutex_init(&federation.lock, NULL);
+  if (-1 == gethostname(federation.name, MAX_PEER_NAME - 6)) {
+    die("'gethostname' failed: %s", system_error());
+  }
+  federation.name[MAX_PEER_NAME - 6] = '\0';
+  sprintf(federation.name + strlen(federation.name), ":%lu", port);
+  for (i = 0; i < federation.link_count; ++i) {
+    resolve_peer(&federation.links[i]);
+  }
+}
+
+/* Takes the limits of -q, the burst being the rate unless given. */
+static int
+parse_limits(char * list) {
+  char * name, * value, * end;
+  size_t length;
+  unsigned long rate, burst;
+  int i;
+  for (name = list; *name; name += length + !!name[length]) {
+    length = strcspn(name, ",");
+    value = memchr(name, '=', length);
+    if (!value) return -1;
+    for (i = 1; i < LIMIT_CLASSES; ++i) {
+      if ((size_t) (value - name) == strlen(limit_names[i]) &&
+          !memcmp(name, limit_names[i], value - name)) {
+        break;
+      }
+    }
+    if (LIMIT_CLASSES == i) return -1;
+    burst = rate = strtoul(value + 1, &end, 10);
+    if (':' == *end) burst = strtoul(end + 1, &end, 10);
+    if (end != name + length || !rate || !burst || MAX_LIMIT < rate ||
+        MAX_LIMIT < burst) {
+      return -1;
+    }
+    config.limits[i].rate = rate;
+    config.limits[i].burst = burst;
+  }
+  return 0;
+}
+
+/* Takes the peers of -p, each as host:port, splitting the list in place. */
+static int
+parse_peers(char * list) {
+  struct Link * link;
+  char * host, * port, * next;
+  for (host = list; host; host = next) {
+    next = strchr(host, ',');
+    if (next) *next++ = '\0';
+    port = strrchr(host, ':');
+    if (!port || port == host || !port[1] ||
+        MAX_PEERS == federation.link_count) {
+      return -1;
+    }
+    *port++ = '\0';
+    link = &federation.links[federation.link_count++];
+    link->host = host;
+    link->port = port;
+  }
+  return 0;
+}
+
+/* Sets an option of -o, left as the system has it when 0. */
+static int
+set_socket_option(int fd, int level, int name, int value) {
+  if (!value) return 0;
+  return setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+/* The options of -o for an accepted socket. main() tries them on a
+   listening socket first, so one the system refuses stops the server at
+   startup; an accepted socket refusing one later, say because its peer has
+   reset it already, is served without it. */
+static int
+set_client_options(int fd) {
+  if (-1 == set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, config.nodelay) ||
+      -1 == set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, config.send_buffer)) {
+    return -1;
+  }
+#ifdef SO_BUSY_POLL
+  return set_socket_option(fd, SOL_SOCKET, SO_BUSY_POLL, config.busy_poll);
+#else
+  return 0;
+#endif
+}
+
+/* With SO_REUSEPORT every worker gets a listening socket of its own and
+   the kernel spreads new connections between them. */
+static int
+open_listener(uint16_t port) {
+  int error, t;
+  struct sockaddr_in server;
+  int server_fd;
+  server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (-1 == server_fd) die("'socket' failed: %s", system_error());
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  server.sin_addr.s_addr = htonl(INADDR_ANY);
+  t = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &t, sizeof(t));
+#ifdef SO_REUSEPORT
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &t, sizeof(t));
+#endif
+  /* accepted sockets inherit it, it sets their window scale */
+  if (-1 == set_socket_option(server_fd, SOL_SOCKET, SO_RCVBUF,
+      config.receive_buffer)) {
+    die("'setsockopt' failed: %s", system_error());
+  }
+#ifdef TCP_DEFER_ACCEPT
+  if (-1 == set_socket_option(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+      config.defer_accept)) {
+    die("'setsockopt' failed: %s", system_error());
+  }
+#endif
+  error = bind(server_fd, (struct sockaddr *) &server, sizeof(server));
+  if (-1 == error) die("'bind' failed: %s", system_error());
+  error = listen(server_fd, config.backlog);
+  if (-1 == error) die("'listen' failed: %s", system_error());
+  return server_fd;
+}
+
+static void
+open_wakeup(int * wakeup) {
+#ifdef __linux__
+  wakeup[0] = wakeup[1] = eventfd(0, EFD_NONBLOCK);
+  if (-1 == wakeup[0]) die("'eventfd' failed: %s", system_error());
+#else
+  if (-1 == pipe(wakeup)) die("'pipe' failed: %s", system_error());
+  if (-1 == fcntl(wakeup[0], F_SETFL, O_NONBLOCK) ||
+      -1 == fcntl(wakeup[1], F_SETFL, O_NONBLOCK)) {
+    die("'fcntl' failed: %s", system_error());
+  }
+#endif
+}
+
+static void
+prepare_server(void) {
+  grow_connections();
+  memset(connections.state, 0, FIRST_CLIENT * sizeof(connections.state[0]));
+  connections.sockets[0].fd = worker->listener;
+  connections.sockets[0].events = POLLIN;
+  connections.sockets[WAKEUP_SLOT].fd = worker->wakeup[0];
+  connections.sockets[WAKEUP_SLOT].events = POLLIN;
+  connections.length = FIRST_CLIENT;
+  watch(0);
+  watch(WAKEUP_SLOT);
+  spare_descriptor = open("/dev/null", O_RDONLY);
+}
+
+/* Signals the workers sleeping with subscribers. Pairs with the 'wanted'
+   store in run_worker: either the worker sees the new head before it sleeps
+   or this sees 'wanted' set. */
+static void
+wake_worker(struct Worker * sleeper) {
+  uint64_t one;
+  one = 1;
+  if (-1 == write(sleeper->wakeup[1], &one, sizeof(one)) && EAGAIN != errno) {
+    die("'write' failed: %s", system_error());
+  }
+}
+
+static void
+wake_workers(void) {
+  int i;
+  for (i = 0; i < config.threads; ++i) {
+    if (&workers[i] == worker) continue;
+    if (!__atomic_exchange_n(&workers[i].wanted, 0, __ATOMIC_SEQ_CST)) continue;
+    wake_worker(&workers[i]);
+  }
+}
+
+static void
+drain_wakeup(void) {
+  uint64_t value[8];
+  while (0 < read(worker->wakeup[0], value, sizeof(value))) { }
+}
+
+static size_t
+block_size(unsigned long length) {
+  return sizeof(struct HistoryBlock) + length * (sizeof(struct timespec) +
+    sizeof(unsigned) + 3 + MAX_RENDERED_LENGTH) + sizeof(unsigned);
+}
+
+/* Points the arrays of a block of 'length' messages past its header, the
+   ones of wider types first so each stays aligned. */
+static void
+lay_out_block(struct HistoryBlock * block, unsigned long length) {
+  char * at;
+  at = (char *) (block + 1);
+  block->length = length;
+  block->time = (struct timespec *) at;
+  at += length * sizeof(block->time[0]);
+  block->offset = (unsigned *) at;
+  at += (length + 1) * sizeof(block->offset[0]);
+  block->nick_length = (unsigned char *) at;
+  at += length;
+  block->published = (unsigned char *) at;
+  at += length;
+  block->relayed = (unsigned char *) at;
+  at += length;
+  block->bytes = at;
+}
+
+/* Spare blocks are shared by all histories, one is taken only by a history
+   with blocks of its length. */
+static struct HistoryBlock *
+take_history_block(unsigned long first, unsigned long length) {
+  struct HistoryBlock ** link, * block;
+  link = &reclaim.spare;
+  while ((block = *link) && block->length != length) link = &block->next;
+  if (block) {
+    *link = block->next;
+    --reclaim.spare_length;
+  } else {
+    if (!(block = malloc(block_size(length)))) die("Out of memory");
+    lay_out_block(block, length);
+  }
+  block->references = 1;
+  block->first = first;
+  block->mapped = 0;
+  block->offset[0] = 0;
+  memset(block->published, 0, length);
+  return block;
+}
+
+/* Takes a reference to a block picked out of the ring, unless it has lost
+   its last one already. */
+static int
+hold_history_block(struct HistoryBlock * block) {
+  int references;
+  references = __atomic_load_n(&block->references, __ATOMIC_RELAXED);
+  do {
+    if (!references) return -1;
+  } while (!__atomic_compare_exchange_n(&block->references, &references,
+      references + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  return 0;
+}
+
+static void
+release_history_block(struct HistoryBlock * block) {
+  if (__atomic_sub_fetch(&block->references, 1, __ATOMIC_ACQ_REL)) return;
+  block->retired = __atomic_add_fetch(&retirement_epoch, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  block->next = reclaim.retired;
+  reclaim.retired = block;
+}
+
+static void
+reclaim_history_blocks(void) {
+  struct HistoryBlock ** link, * block;
+  unsigned long oldest, epoch;
+  int i;
+  oldest = EPOCH_OFFLINE;
+  for (i = 0; i < config.threads; ++i) {
+    epoch = __atomic_load_n(&workers[i].epoch, __ATOMIC_SEQ_CST);
+    if (epoch < oldest) oldest = epoch;
+  }
+  link = &reclaim.retired;
+  while ((block = *link)) {
+    if (block->retired > oldest) {
+      link = &block->next;
+      continue;
+    }
+    *link = block->next;
+    if (block->mapped) {
+      munmap(block, block_size(block->length));
+      continue;
+    }
+    if (reclaim.spare_length == MAX_SPARE_BLOCKS) {
+      free(block);
+      continue;
+    }
+    block->next = reclaim.spare;
+    reclaim.spare = block;
+    ++reclaim.spare_length;
+  }
+}
+
+/* Between loop iterations a worker holds no block it has not referenced,
+   so it is quiescent while it sleeps. Waking up it catches up with the
+   epoch; the fence pairs with the one in release_history_block, so either
+   the worker counts as older than the retirement or it can no longer find
+   the retired block in the ring. */
+static void
+go_offline(void) {
+  __atomic_store_n(&worker->epoch, EPOCH_OFFLINE, __ATOMIC_SEQ_CST);
+}
+
+static void
+go_online(void) {
+  __atomic_store_n(&worker->epoch,
+    __atomic_load_n(&retirement_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (reclaim.retired) reclaim_history_blocks();
+}
+
+static size_t
+buffer_size(int size_class) {
+  return sizeof(struct LinkedBuffer) + buffer_capacity[size_class];
+}
+
+static int
+grow_pool(int size_class) {
+  char * slab;
+  struct LinkedBuffer * buffer;
+  size_t size;
+  int i;
+  size = buffer_size(size_class);
+  slab = malloc(size * BUFFER_POOL_SIZE);
+  if (!slab) return -1;
+  pool.allocated += size * BUFFER_POOL_SIZE;
+  for (i = 0; i < BUFFER_POOL_SIZE; ++i) {
+    buffer = (struct LinkedBuffer *) (slab + i * size);
+    buffer->storage = (char *) (buffer + 1);
+    buffer->capacity = buffer_capacity[size_class];
+    buffer->size_class = size_class;
+    buffer->next = pool.free[size_class];
+    pool.free[size_class] = buffer;
+  }
+  count(COUNTER_FREE_SLICE_BUFFERS + size_class, BUFFER_POOL_SIZE);
+  return 0;
+}
+
+static struct LinkedBuffer *
+take_buffer(int size_class) {
+  struct LinkedBuffer * buffer;
+  if (!pool.free[size_class] && -1 == grow_pool(size_class)) return NULL;
+  buffer = pool.free[size_class];
+  pool.free[size_class] = buffer->next;
+  pool.used += buffer_size(size_class);
+  count(COUNTER_BUFFER_POOL_BYTES, buffer_size(size_class));
+  count(COUNTER_FREE_SLICE_BUFFERS + size_class, -1);
+  buffer->used = 0;
+  buffer->block = NULL;
+  buffer->data = buffer->storage;
+  buffer->sent = 0;
+  buffer->next = NULL;
+  return buffer;
+}
+
+static void
+release_buffer(struct LinkedBuffer * buffer) {
+  if (buffer->block) release_history_block(buffer->block);
+  pool.used -= buffer_size(buffer->size_class);
+  count(COUNTER_BUFFER_POOL_BYTES, -buffer_size(buffer->size_class));
+  count(COUNTER_FREE_SLICE_BUFFERS + buffer->size_class, 1);
+  buffer->next = pool.free[buffer->size_class];
+  pool.free[buffer->size_class] = buffer;
+}
+
+static struct Buffer *
+take_input_buffer(void) {
+  struct Buffer * buffer;
+  buffer = pool.free_input;
+  if (buffer) {
+    pool.free_input = buffer->next;
+    count(COUNTER_FREE_INPUT_BUFFERS, -1);
+  } else {
+    if (!(buffer = malloc(sizeof(*buffer) + config.input_buffer))) return NULL;
+    buffer->data = (char *) (buffer + 1);
+  }
+  buffer->used = buffer->scanned = 0;
+  return buffer;
+}
+
+static void
+release_input_buffer(int client) {
+  struct Buffer * buffer;
+  buffer = connections.data[client].input;
+  if (!buffer) return;
+  buffer->next = pool.free_input;
+  pool.free_input = buffer;
+  count(COUNTER_FREE_INPUT_BUFFERS, 1);
+  connections.data[client].input = NULL;
+}
+
+static void
+release_buffers(struct ListOfBuffers * list) {
+  struct LinkedBuffer * buffer;
+  while (list->first) {
+    buffer = list->first;
+    list->first = buffer->next;
+    release_buffer(buffer);
+  }
+  list->last = NULL;
+}
+
+static void
+wait_for_memory(int client) {
+  struct ConnectionState * state;
+  state = &connections.state[client];
+  if (state->waiting) return;
+  state->waiting = 1;
+  state->next_waiting = pool.waiting;
+  pool.waiting = client;
+  update_interest(client);
+}
+
+static void
+link_buffer(struct ListOfBuffers * list, struct LinkedBuffer * buffer) {
+  if (!list->last) list->first = buffer;
+  else list->last->next = buffer;
+  list->last = buffer;
+}
+
+static void
+count_queued(int client, size_t size) {
+  struct ConnectionState * state;
+  state = &connections.state[client];
+  state->queued += size;
+  count(COUNTER_QUEUED_BYTES, size);
+  if (!state->paused && state->queued >= config.high_watermark) {
+    pause_connection(client);
+  }
+}
+
+/* Copies 'size' bytes to the end of 'list', -1 when out of memory. */
+static int
+put_bytes(struct ListOfBuffers * list, const char * message, size_t size) {
+  struct LinkedBuffer * last;
+  size_t stored, part_size;
+  int size_class;
+  for (stored = 0; stored < size; stored += part_size) {
+    last = list->last;
+    if (!last || last->block || last->used == last->capacity) {
+      /* a reply that filled a buffer goes on in large ones */
+      size_class = size - stored > SMALL_BUFFER_SIZE || (last && !last->block)
+        ? LARGE_BUFFER : SMALL_BUFFER;
+      if (!(last = take_buffer(size_class))) return -1;
+      link_buffer(list, last);
+    }
+    part_size = MIN((size_t) (last->capacity - last->used), size - stored);
+    memcpy(last->storage + last->used, message + stored, part_size);
+    last->used += part_size;
+  }
+  return 0;
+}
+
+/* Running out of memory closes the connection the reply was for, further
+   output for it is dropped. */
+static void
+send_bytes(int client, const char * message, size_t size) {
+  if (connections.state[client].closed) return;
+  if (-1 == put_bytes(&connections.state[client].pending_to_be_sent, message,
+      size)) {
+    close_connection(client);
+    return;
+  }
+  update_interest(client);
+  count_queued(client, size);
+}
+
+/* Moves the buffers of 'list', 'size' bytes in all, to the end of the
+   output of 'client'. */
+static void
+send_list(int client, struct ListOfBuffers * list, size_t size) {
+  struct ListOfBuffers * pending;
+  if (!list->first) return;
+  pending = &connections.state[client].pending_to_be_sent;
+  if (!pending->last) pending->first = list->first;
+  else pending->last->next = list->first;
+  pending->last = list->last;
+  list->first = list->last = NULL;
+  update_interest(client);
+  count_queued(client, size);
+}
+
+static void
+send_later(int client, char * message) {
+  send_bytes(client, message, strlen(message));
+}
+
+static void
+send_package(int client, char * message) {
+  send_later(client, message);
+  send_later(client, "\r\n");
+}
+
+/* Writes 'value' as a varint at 'at', returns the bytes it took. */
+static size_t
+put_varint(unsigned char * at, unsigned long value) {
+  size_t n;
+  for (n = 0; value >= 0x80; value >>= 7) at[n++] = (value & 0x7f) | 0x80;
+  at[n++] = value;
+  return n;
+}
+
+static size_t
+varint_length(unsigned long value) {
+  size_t n;
+  for (n = 1; value >= 0x80; value >>= 7) ++n;
+  return n;
+}
+
+/* Reads a varint from the 'size' bytes at 'at'. Returns the bytes it took,
+   0 when they end before it does, -1 when it does not fit. */
+static int
+get_varint(const unsigned char * at, size_t size, unsigned long * value) {
+  size_t n;
+  *value = 0;
+  for (n = 0; n < size; ++n) {
+    if (7 * n >= sizeof(*value) * CHAR_BIT) return -1;
+    *value |= (unsigned long) (at[n] & 0x7f) << 7 * n;
+    if (!(at[n] & 0x80)) return n + 1;
+  }
+  return 0;
+}
+
+static void
+put_little_endian(unsigned char * at, uint64_t value, int size) {
+  int i;
+  for (i = 0; i < size; ++i, value >>= 8) at[i] = value & 0xff;
+}
+
+/* Starts a binary frame of 'type' with 'size' bytes of fields to follow. */
+static void
+send_frame_header(int client, int type, size_t size) {
+  unsigned char header[MAX_VARINT_LENGTH + 1];
+  size_t n;
+  n = put_varint(header, size + 1);
+  header[n++] = type;
+  send_bytes(client, (char *) header, n);
+}
+
+static void
+send_frame(int client, int type, const unsigned char * fields, size_t size) {
+  send_frame_header(client, type, size);
+  send_bytes(client, (const char *) fields, size);
+}
+
+/* Tells the client a command was refused, in a line marked with '!' or a
+   frame. */
+static void
+send_error(int client, const char * text) {
+  char outgoing[MAX_PACKAGE_LENGTH];
+  if (connections.state[client].binary) {
+    send_frame(client, FRAME_ERROR, (const unsigned char *) text,
+      strlen(text));
+    return;
+  }
+  sprintf(outgoing, "!%.*s", (int) sizeof(outgoing) - 2, text);
+  send_package(client, outgoing);
+}
+
+/* Returns -1 out of memory. */
+static int
+init_history(struct History * history, unsigned long retention,
+    unsigned long block_length) {
+  history->retention = retention;
+  history->block_length = block_length;
+  history->length = (retention + block_length - 1) / block_length + 2;
+  history->blocks = calloc(history->length, sizeof(history->blocks[0]));
+  return history->blocks ? 0 : -1;
+}
+
+static unsigned long
+history_head(struct History * history) {
+  return __atomic_load_n(&history->next, __ATOMIC_SEQ_CST);
+}
+
+/* First message retained while 'next' is the head. */
+static unsigned long
+history_first(struct History * history, unsigned long next) {
+  unsigned long first;
+  first = next > history->retention ? next - history->retention : 0;
+  return first > history->oldest ? first : history->oldest;
+}
+
+static struct HistoryBlock **
+history_slot(struct History * history, unsigned long message) {
+  return &history->blocks[message / history->block_length % history->length];
+}
+
+static struct HistoryBlock *
+history_block(struct History * history, unsigned long message) {
+  return __atomic_load_n(history_slot(history, message), __ATOMIC_ACQUIRE);
+}
+
+/* The wall clock, but never earlier than a time handed out before: a call
+   that starts after another has returned gets a time not older than its. */
+static struct timespec
+history_time(struct History * history) {
+  struct timespec now;
+  uint64_t wanted, latest;
+  now = get_time();
+  wanted = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  latest = __atomic_load_n(&history->clock, __ATOMIC_SEQ_CST);
+  while (latest < wanted && !__atomic_compare_exchange_n(&history->clock,
+      &latest, wanted, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+  }
+  if (latest > wanted) {
+    now.tv_sec = latest / 1000000000;
+    now.tv_nsec = latest % 1000000000;
+  }
+  return now;
+}
+
+static int
+older(struct timespec a, struct timespec b) {
+  return a.tv_sec < b.tv_sec ||
+    (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+static struct timespec
+message_time(struct History * history, unsigned long message) {
+  return history_block(history, message)->
+    time[message % history->block_length];
+}
+
+/* First retained message that is not older than 'time'. Writers lapping
+   the ring during the search can only make it land off the mark, the
+   blocks it looks at stay allocated until this worker is quiescent. */
+static unsigned long
+find_in_history(struct History * history, struct timespec time) {
+  unsigned long low, high, middle;
+  high = history_head(history);
+  low = history_first(history, high);
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (older(message_time(history, middle), time)) low = middle + 1;
+    else high = middle;
+  }
+  return low;
+}
+
+/* Moves the head past the messages published in a row from it. Every
+   writer tries after publishing, so the last one of a row gets it done. */
+static void
+advance_history(struct History * history) {
+  struct HistoryBlock * block;
+  unsigned long next, position;
+  next = history_head(history);
+  while (1) {
+    position = next % history->block_length;
+    block = history_block(history, next);
+    if (!block || block->first != next - position) return;
+    if (!__atomic_load_n(&block->published[position], __ATOMIC_SEQ_CST)) {
+      return;
+    }
+    if (__atomic_compare_exchange_n(&history->next, &next, next + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      ++next;
+    }
+  }
+}
+
+static const char *
+render_stamp(time_t second) {
+  struct tm pretty_time;
+  if (stamp.rendered[0] && stamp.second == second) return stamp.rendered;
+  if (!localtime_r(&second, &pretty_time)) {
+    memset(&pretty_time, 0, sizeof(pretty_time));
+  }
+  sprintf(stamp.rendered, "[%02d:%02d:%02d]",
+    pretty_time.tm_hour, pretty_time.tm_min, pretty_time.tm_sec);
+  stamp.second = second;
+  return stamp.rendered;
+}
+
+static void
+add_to_history(struct History * history, char * nick,
+    char * message, int relayed) {
+  char * rendered;
+  struct HistoryBlock ** slot, * block, * old;
+  struct timespec now;
+  uint64_t tail, reserved;
+  unsigned long sequence, position;
+  unsigned start, length, nick_length, message_length;
+  nick_length = strlen(nick);
+  message_length = strlen(message);
+  length = TIMESTAMP_LENGTH + nick_length + message_length + 5;
+  tail = __atomic_load_n(&history->tail, __ATOMIC_SEQ_CST);
+  while (1) {
+    sequence = tail >> OFFSET_BITS;
+    if (sequence / history->block_length >
+        history_head(history) / history->block_length + 1) {
+      /* a writer before this one has not published yet */
+      sched_yield();
+      tail = __atomic_load_n(&history->tail, __ATOMIC_SEQ_CST);
+      continue;
+    }
+    start = sequence % history->block_length
+      ? tail & ((1UL << OFFSET_BITS) - 1) : 0;
+    reserved = (uint64_t) (sequence + 1) << OFFSET_BITS | (start + length);
+    now = history_time(history);
+    if (__atomic_compare_exchange_n(&history->tail, &tail, reserved, 1,
+        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      break;
+    }
+  }
+  position = sequence % history->block_length;
+  slot = history_slot(history, sequence);
+  if (!position) {
+    old = *slot;
+    __atomic_store_n(slot, take_history_block(sequence,
+      history->block_length), __ATOMIC_RELEASE);
+    if (old) release_history_block(old);
+  }
+  /* the writer of the first message of a block installs it, the others
+     of the block wait for that */
+  while (!(block = history_block(history, sequence)) ||
+      block->first != sequence - position) {
+    sched_yield();
+  }
+  /* pieced together in place, a NUL would land on the next writer's
+     bytes */
+  rendered = block->bytes + start;
+  memcpy(rendered, render_stamp(now.tv_sec), TIMESTAMP_LENGTH);
+  rendered += TIMESTAMP_LENGTH;
+  *rendered++ = ' ';
+  memcpy(rendered, nick, nick_length);
+  rendered += nick_length;
+  memcpy(rendered, ": ", 2);
+  memcpy(rendered + 2, message, message_length);
+  memcpy(rendered + 2 + message_length, "\r\n", 2);
+  block->offset[position + 1] = start + length;
+  block->nick_length[position] = nick_length;
+  block->relayed[position] = relayed;
+  block->time[position] = now;
+  __atomic_store_n(&block->published[position], 1, __ATOMIC_SEQ_CST);
+  advance_history(history);
+  worker->appended = 1;
+  count(COUNTER_MESSAGES_STORED, 1);
+}
+
+static void
+journal_path(char * path, unsigned long first) {
+  if (PATH_MAX <= snprintf(path, PATH_MAX, "%s/%020lu.block",
+      journal.directory, first)) {
+    die("journal path is too long");
+  }
+}
+
+static struct HistoryBlock *
+map_history_block(unsigned long first) {
+  char path[PATH_MAX];
+  struct HistoryBlock * block;
+  struct stat status;
+  int fd;
+  journal_path(path, first);
+  fd = open(path, O_RDONLY);
+  if (-1 == fd && ENOENT == errno) return NULL;
+  if (-1 == fd) die("'open' %s failed: %s", path, system_error());
+  if (-1 == fstat(fd, &status)) die("'fstat' failed: %s", system_error());
+  if (block_size(HISTORY_BLOCK_LENGTH) != (size_t) status.st_size) {
+    die("%s is not a history block", path);
+  }
+  /* private, so the runtime fields can be set without touching the file */
+  block = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+    fd, 0);
+  if (MAP_FAILED == block) die("'mmap' failed: %s", system_error());
+  close(fd);
+  lay_out_block(block, HISTORY_BLOCK_LENGTH);
+  block->references = 1;
+  block->first = first;
+  block->mapped = 1;
+  return block;
+}
+
+/* Maps the blocks holding the retained part of the journal back into the
+   ring and goes on after the last message found. The retention starts
+   after a block found missing, and the files before it are removed. */
+static void
+restore_history(void) {
+  DIR * directory;
+  struct dirent * entry;
+  struct HistoryBlock * block;
+  unsigned long first, last, next, count;
+  char * end;
+  char path[PATH_MAX];
+  int found;
+  if (!(directory = opendir(journal.directory))) {
+    if (ENOENT != errno || -1 == mkdir(journal.directory, 0777)) {
+      die("can't open the journal: %s", system_error());
+    }
+    return;
+  }
+  found = 0;
+  last = 0;
+  while ((entry = readdir(directory))) {
+    first = strtoul(entry->d_name, &end, 10);
+    if (end == entry->d_name || strcmp(end, ".block")) continue;
+    if (first % HISTORY_BLOCK_LENGTH) continue;
+    if (!found || first > last) last = first;
+    found = 1;
+  }
+  if (!found) {
+    closedir(directory);
+    return;
+  }
+  block = map_history_block(last);
+  for (count = 0; count < HISTORY_BLOCK_LENGTH && block->offset[count + 1];
+      ++count) {
+  }
+  next = last + count;
+  *history_slot(&lobby, last) = block;
+  first = history_first(&lobby, next);
+  for (journal.removed = last;
+      journal.removed > first - first % HISTORY_BLOCK_LENGTH;
+      journal.removed -= HISTORY_BLOCK_LENGTH) {
+    block = map_history_block(journal.removed - HISTORY_BLOCK_LENGTH);
+    if (!block) break;
+    *history_slot(&lobby, journal.removed - HISTORY_BLOCK_LENGTH) = block;
+  }
+  lobby.oldest = journal.removed;
+  rewinddir(directory);
+  while ((entry = readdir(directory))) {
+    first = strtoul(entry->d_name, &end, 10);
+    if (end == entry->d_name || strcmp(end, ".block")) continue;
+    if (first >= journal.removed) continue;
+    journal_path(path, first);
+    if (-1 == unlink(path) && ENOENT != errno) {
+      die("can't remove %s: %s", path, system_error());
+    }
+  }
+  closedir(directory);
+  block = *history_slot(&lobby, last);
+  lobby.next = next;
+  lobby.tail = (uint64_t) next << OFFSET_BITS | block->offset[count];
+  if (count) {
+    lobby.clock = (uint64_t) block->time[count - 1].tv_sec * 1000000000 +
+      block->time[count - 1].tv_nsec;
+  }
+}
+
+static void
+journal_write(const void * data, size_t size, size_t offset) {
+  ssize_t written;
+  while (size) {
+    written = pwrite(journal.fd, data, size, offset);
+    if (-1 == written) {
+      if (EINTR == errno) continue;
+      die("can't write the journal: %s", system_error());
+    }
+    data = (const char *) data + written;
+    size -= written;
+    offset += written;
+  }
+}
+
+/* Where an element of a field of 'block' is in its file. */
+#define FIELD(block, field, position) \
+  ((const char *) ((block)->field + (position)) - (const char *) (block))
+
+/* Syncs the file, then marks the messages that made durable complete,
+   which leaves it dirty until the next sync. */
+static void
+sync_journal(void) {
+  if (-1 == fdatasync(journal.fd)) {
+    die("can't sync the journal: %s", system_error());
+  }
+  journal.dirty = 0;
+  journal.synced = get_time();
+  if (!journal.unmarked) return;
+  journal_write(journal.offsets,
+    journal.unmarked * sizeof(journal.offsets[0]), journal.marked);
+  journal.marked += journal.unmarked * sizeof(journal.offsets[0]);
+  journal.unmarked = 0;
+  journal.dirty = 1;
+}
+
+static void
+open_journal_file(unsigned long first) {
+  char path[PATH_MAX];
+  if (-1 != journal.fd) {
+    while (journal.dirty) sync_journal();
+    close(journal.fd);
+  }
+  while (journal.removed + HISTORY_BLOCK_LENGTH <=
+      history_first(&lobby, first)) {
+    journal_path(path, journal.removed);
+    if (-1 == unlink(path) && ENOENT != errno) {
+      die("can't remove %s: %s", path, system_error());
+    }
+    journal.removed += HISTORY_BLOCK_LENGTH;
+  }
+  journal_path(path, first);
+  journal.fd = open(path, O_WRONLY | O_CREAT, 0666);
+  if (-1 == journal.fd) die("'open' %s failed: %s", path, system_error());
+  if (-1 == ftruncate(journal.fd, block_size(HISTORY_BLOCK_LENGTH))) {
+    die("'ftruncate' failed: %s", system_error());
+  }
+  journal.file = first;
+}
+
+/* Writes the messages stored since the last call, one block at a time. The
+   blocks are referenced while they are written, so the thread need not
+   count as reading the ring meanwhile. */
+static void
+write_journal(void) {
+  struct HistoryBlock * block;
+  unsigned long next, at, base, end, begin, last;
+  next = history_head(&lobby);
+  while (journal.written < next) {
+    at = journal.written;
+    base = at - at % HISTORY_BLOCK_LENGTH;
+    end = MIN(base + HISTORY_BLOCK_LENGTH, next) - base;
+    block = history_block(&lobby, at);
+    if (-1 == hold_history_block(block)) block = NULL;
+    if (block && block->first != base) {
+      release_history_block(block);
+      block = NULL;
+    }
+    if (!block) {
+      /* the writers lapped the journal, what it missed is gone */
+      journal.written = history_first(&lobby, history_head(&lobby));
+      continue;
+    }
+    at -= base;
+    go_offline();
+    if (-1 == journal.fd || journal.file != base) open_journal_file(base);
+    begin = block->offset[at];
+    last = block->offset[end];
+    journal_write(block->bytes + begin, last - begin,
+      FIELD(block, bytes, begin));
+    journal_write(block->time + at, (end - at) * sizeof(block->time[0]),
+      FIELD(block, time, at));
+    journal_write(block->nick_length + at, end - at,
+      FIELD(block, nick_length, at));
+    journal_write(block->relayed + at, end - at, FIELD(block, relayed, at));
+    /* the file only changes at the start of a block, so within one the
+       messages come in a row */
+    if (!journal.unmarked) journal.marked = FIELD(block, offset, at + 1);
+    memcpy(journal.offsets + journal.unmarked, block->offset + at + 1,
+      (end - at) * sizeof(block->offset[0]));
+    journal.unmarked += end - at;
+    journal.dirty = 1;
+    if (!journal.sync_interval) sync_journal();
+    go_online();
+    release_history_block(block);
+    journal.written = base + end;
+  }
+}
+
+static long
+milliseconds_since(struct timespec time) {
+  struct timespec now;
+  now = get_time();
+  return (now.tv_sec - time.tv_sec) * 1000 +
+    (now.tv_nsec - time.tv_nsec) / 1000000;
+}
+
+/* Counts this thread as done handing over and waits for the process to
+   exit. */
+static void
+finish_hand_over(void) {
+  pthread_mutex_lock(&upgrade.lock);
+  ++upgrade.done;
+  pthread_cond_broadcast(&upgrade.handed_over);
+  pthread_mutex_unlock(&upgrade.lock);
+  go_offline();
+  while (1) pause();
+}
+
+/* The journal writer sleeps like a worker, with 'wanted' set so it gets
+   woken for new messages, and until the next sync is due if there is
+   something to sync. */
+static void *
+run_journal(void * argument) {
+  struct pollfd wakeup;
+  long timeout;
+  worker = argument;
+  wakeup.fd = worker->wakeup[0];
+  wakeup.events = POLLIN;
+  go_online();
+  while (1) {
+    __atomic_store_n(&worker->wanted, 1, __ATOMIC_SEQ_CST);
+    if (journal.written == history_head(&lobby)) {
+      timeout = -1;
+      if (journal.dirty) {
+        timeout = journal.sync_interval - milliseconds_since(journal.synced);
+        if (timeout < 0) timeout = 0;
+      }
+      go_offline();
+      if (-1 == poll(&wakeup, 1, timeout) && EINTR != errno) {
+        die("'poll' failed: %s", system_error());
+      }
+      go_online();
+      drain_wakeup();
+    }
+    write_journal();
+    if (__atomic_load_n(&upgrade.done, __ATOMIC_SEQ_CST) == config.workers) {
+      /* the workers have stopped, nothing is stored past this */
+      write_journal();
+      while (journal.dirty) sync_journal();
+      finish_hand_over();
+    }
+    if (journal.dirty &&
+        milliseconds_since(journal.synced) >= journal.sync_interval) {
+      sync_journal();
+    }
+  }
+  return NULL;
+}
+
+#define PACKAGE_BEGIN_MY_NAME_IS "my name is "
+#define PACKAGE_BEGIN_SEND "send "
+#define PACKAGE_FOLKS "folks"
+#define PACKAGE_BEGIN_FOLKS_PAGE "folks "
+#define PACKAGE_FOLKS_COUNT "folks count"
+#define PACKAGE_SUBSCRIBE_FOLKS "subscribe folks"
+#define PACKAGE_UNSUBSCRIBE_FOLKS "unsubscribe folks"
+#define PACKAGE_NEW "new"
+#define PACKAGE_BEGIN_NEW_SINCE "new since "
+#define PACKAGE_STATS "stats"
+#define PACKAGE_SUBSCRIBE "subscribe"
+#define PACKAGE_UNSUBSCRIBE "unsubscribe"
+#define PACKAGE_BINARY "binary"
+#define PACKAGE_COMPRESS "compress"
+#define PACKAGE_BEGIN_JOIN "join "
+#define PACKAGE_BEGIN_LEAVE "leave "
+#define PACKAGE_BEGIN_POST "post "
+#define PACKAGE_BEGIN_NEW_IN "new in "
+#define PACKAGE_BEGIN_FOLKS_IN "folks in "
+#define PACKAGE_BEGIN_PEER "peer "
+#define PACKAGE_BEGIN_AT "at "
+#define PACKAGE_BEGIN_RELAY "relay "
+#define PACKAGE_BEGIN_JOINED "joined "
+#define PACKAGE_BEGIN_LEFT "left "
+
+/* Puts the messages [at, end) of 'block' into 'list' as one slice, which
+   takes over the reference to the block. Returns the bytes put, -1 when out
+   of memory. */
+static long
+put_run(struct ListOfBuffers * list, struct HistoryBlock * block,
+    unsigned long at, unsigned long end) {
+  struct LinkedBuffer * run;
+  unsigned first, last;
+  if (!(run = take_buffer(SLICE_BUFFER))) {
+    release_history_block(block);
+    return -1;
+  }
+  first = block->offset[at % block->length];
+  last = block->offset[(end - 1) % block->length + 1];
+  run->block = block;
+  run->data = block->bytes + first;
+  run->used = last - first;
+  link_buffer(list, run);
+  return run->used;
+}
+
+/* Puts the messages [at, end) of 'block' into 'list' as binary frames,
+   picking nick and text out of the rendered lines, and lets go of the
+   block. */
+static long
+put_frames(struct ListOfBuffers * list, struct HistoryBlock * block,
+    unsigned long at, unsigned long end) {
+  unsigned char frame[MAX_MESSAGE_FRAME], * field;
+  const char * line;
+  unsigned long sequence;
+  size_t nick_length, text_length, size;
+  long put;
+  int position;
+  for (put = 0, sequence = at; sequence < end; ++sequence) {
+    position = sequence % block->length;
+    line = block->bytes + block->offset[position] + TIMESTAMP_LENGTH + 1;
+    nick_length = block->nick_length[position];
+    text_length = block->offset[position + 1] - block->offset[position] -
+      TIMESTAMP_LENGTH - nick_length - 5;
+    size = 1 + varint_length(sequence) + 14 + nick_length + text_length;
+    field = frame + put_varint(frame, size);
+    *field++ = FRAME_MESSAGE;
+    field += put_varint(field, sequence);
+    put_little_endian(field, block->time[position].tv_sec, 8);
+    put_little_endian(field + 8, block->time[position].tv_nsec, 4);
+    field += 12;
+    *field++ = nick_length;
+    *field++ = text_length;
+    memcpy(field, line, nick_length);
+    field += nick_length;
+    memcpy(field, line + nick_length + 2, text_length);
+    field += text_length;
+    if (-1 == put_bytes(list, (char *) frame, field - frame)) {
+      put = -1;
+      break;
+    }
+    put += field - frame;
+  }
+  release_history_block(block);
+  return put;
+}
+
+/* Collects the messages [from, next) into 'list', adding their bytes to
+   'size'. Returns -1 when writers have lapped the ring meanwhile and a
+   block has been recycled, -2 when out of memory. */
+static int
+collect_history(struct History * history, struct ListOfBuffers * list,
+    size_t * size, unsigned long from, unsigned long next, int binary) {
+  struct HistoryBlock * block;
+  unsigned long at, base, end;
+  long put;
+  for (at = from; at < next; at = end) {
+    base = at - at % history->block_length;
+    end = MIN(base + history->block_length, next);
+    block = history_block(history, at);
+    if (-1 == hold_history_block(block)) return -1;
+    if (block->first != base) {
+      release_history_block(block);
+      return -1;
+    }
+    put = binary ? put_frames(list, block, at, end)
+      : put_run(list, block, at, end);
+    if (-1 == put) return -2;
+    *size += put;
+  }
+  return 0;
+}
+
+#ifdef USE_ZLIB
+/* Every worker has a compressor, started afresh for each reply, so a
+   connection keeps no stream of its own. */
+static __thread struct {
+  z_stream stream;
+  int ready;
+} deflater;
+
+/* Replaces the 'size' bytes in 'list' with one zlib stream of them and
+   'size' with its length. Returns -1 when out of memory. */
+static int
+compress_list(struct ListOfBuffers * list, size_t * size) {
+  struct ListOfBuffers compressed;
+  struct LinkedBuffer * buffer, * out;
+  z_stream * stream;
+  int flush, result;
+  stream = &deflater.stream;
+  if (deflater.ready) deflateReset(stream);
+  else if (Z_OK == deflateInit(stream, Z_BEST_SPEED)) deflater.ready = 1;
+  else return -1;
+  compressed.first = compressed.last = out = NULL;
+  for (buffer = list->first; ; buffer = buffer->next) {
+    flush = buffer ? Z_NO_FLUSH : Z_FINISH;
+    stream->next_in = buffer ? (Bytef *) buffer->data : Z_NULL;
+    stream->avail_in = buffer ? buffer->used : 0;
+    do {
+      if (!out || out->used == out->capacity) {
+        if (!(out = take_buffer(LARGE_BUFFER))) {
+          release_buffers(&compressed);
+          return -1;
+        }
+        link_buffer(&compressed, out);
+      }
+      stream->next_out = (Bytef *) out->storage + out->used;
+      stream->avail_out = out->capacity - out->used;
+      result = deflate(stream, flush);
+      out->used = out->capacity - stream->avail_out;
+    } while (stream->avail_in || (Z_FINISH == flush && Z_STREAM_END != result));
+    if (!buffer) break;
+  }
+  count(COUNTER_COMPRESSED_BYTES_IN, *size);
+  count(COUNTER_COMPRESSED_BYTES_OUT, stream->total_out);
+  release_buffers(list);
+  *list = compressed;
+  *size = stream->total_out;
+  return 0;
+}
+#endif
+
+/* Sends the messages from 'message' on after their count, marked when
+   they are pushed, along with the name of the room they were posted in
+   unless that is the lobby. Text goes out as one contiguous run per block.
+   Binary frames are copied out of the same blocks. Either is compressed
+   when large and the client asked for it. The messages are
+   collected first; should a block have been recycled meanwhile, collecting
+   starts over from the new head. Returns the new cursor. */
+static unsigned long
+send_history(int client, struct History * history, const struct Room * room,
+    unsigned long message, int push) {
+  char outgoing[MAX_PACKAGE_LENGTH];
+  unsigned char fields[MAX_VARINT_LENGTH + 1 + MAX_ROOM_LENGTH];
+  struct ListOfBuffers messages;
+  unsigned long next, from;
+  size_t size, n;
+  int binary, result;
+#ifdef USE_ZLIB
+  int compressed;
+#endif
+  if (connections.state[client].closed) return message;
+  binary = connections.state[client].binary;
+  messages.first = messages.last = NULL;
+  do {
+    release_buffers(&messages);
+    size = 0;
+    next = history_head(history);
+    from = history_first(history, next);
+    if (message > from) from = message;
+    result = collect_history(history, &messages, &size, from, next, binary);
+  } while (-1 == result);
+#ifdef USE_ZLIB
+  compressed = connections.state[client].compressed &&
+    size > COMPRESS_THRESHOLD;
+  if (compressed && -1 == compress_list(&messages, &size)) result = -2;
+#endif
+  if (-2 == result) {
+    release_buffers(&messages);
+    close_connection(client);
+    return message;
+  }
+  if (binary) {
+    n = put_varint(fields, next - from);
+    if (room) {
+      fields[n++] = room->length;
+      memcpy(fields + n, room->name, room->length);
+      n += room->length;
+    }
+    send_frame(client, room ? FRAME_ROOM_PUSH : push ? FRAME_PUSH
+      : FRAME_COUNT, fields, n);
+  } else {
+    sprintf(outgoing, "%s%lu%s%s", push ? "+" : "", next - from,
+      room ? " " : "", room ? room->name : "");
+    send_package(client, outgoing);
+  }
+#ifdef USE_ZLIB
+  if (compressed && binary) {
+    send_frame_header(client, FRAME_COMPRESSED, size);
+  } else if (compressed) {
+    sprintf(outgoing, "~%lu", (unsigned long) size);
+    send_package(client, outgoing);
+  }
+#endif
+  if (connections.state[client].closed) {
+    release_buffers(&messages);
+    return message;
+  }
+  send_list(client, &messages, size);
+  return next;
+}
+
+static void
+subscribe(int client) {
+  struct ConnectionState * state;
+  state = &connections.state[client];
+  if (state->subscribed) return;
+  state->subscribed = 1;
+  state->previous_subscriber = 0;
+  state->next_subscriber = subscribers.first;
+  if (subscribers.first) {
+    connections.state[subscribers.first].previous_subscriber = client;
+  }
+  subscribers.first = client;
+  subscribers.lagging = 1;
+  if (connections.data[client].memberships) local_rooms.lagging = 1;
+}
+
+static void
+unsubscribe(int client) {
+  struct ConnectionState * state;
+  state = &connections.state[client];
+  if (!state->subscribed) return;
+  state->subscribed = 0;
+  if (state->previous_subscriber) {
+    connections.state[state->previous_subscriber].next_subscriber =
+      state->next_subscriber;
+  } else {
+    subscribers.first = state->next_subscriber;
+  }
+  if (state->next_subscriber) {
+    connections.state[state->next_subscriber].previous_subscriber =
+      state->previous_subscriber;
+  }
+}
+
+static void
+push_to_subscribers(void) {
+  int client;
+  unsigned long next;
+  struct ConnectionState * state;
+  next = history_head(&lobby);
+  for (client = subscribers.first; client; client = state->next_subscriber) {
+    state = &connections.state[client];
+    if (state->closed || state->paused) continue;
+    if (connections.data[client].cursor >= next) continue;
+    connections.data[client].cursor = send_history(client, &lobby, NULL,
+      connections.data[client].cursor, 1);
+  }
+  subscribers.pushed = next;
+  subscribers.lagging = 0;
+}
+
+/* Sends at most 'limit' nicks from position 'from' of the 'length' roster
+entries in 'order' on, after their count behind 'prefix', or as a frame of
+'type'. With the lock held. */
+static void
+send_roster_page(int client, const char * prefix, int type, const int * order,
+    unsigned long length, unsigned long from, unsigned long limit) {
+  char chunk[LARGE_BUFFER_SIZE], outgoing[MAX_PACKAGE_LENGTH];
+  unsigned char count[MAX_VARINT_LENGTH];
+  struct RosterEntry * entry;
+  unsigned long i, end;
+  size_t used, size, n;
+  int binary;
+  binary = connections.state[client].binary;
+  if (from > length) from = length;
+  end = from + MIN(limit, length - from);
+  if (binary) {
+    n = put_varint(count, end - from);
+    for (size = n, i = from; i < end; ++i) {
+      size += 1 + roster.entries[order[i]].length;
+    }
+    send_frame_header(client, type, size);
+    send_bytes(client, (char *) count, n);
+  } else {
+    sprintf(outgoing, "%s%lu", prefix, end - from);
+    send_package(client, outgoing);
+  }
+  for (used = 0, i = from; i < end; ++i) {
+    if (used > sizeof(chunk) - MAX_NICK_LENGTH - 2) {
+      send_bytes(client, chunk, used);
+      used = 0;
+    }
+    entry = &roster.entries[order[i]];
+    if (binary) chunk[used++] = entry->length;
+    memcpy(chunk + used, entry->line, entry->length + 2 * !binary);
+    used += entry->length + 2 * !binary;
+  }
+  send_bytes(client, chunk, used);
+}
+
+static void
+send_roster(int client, unsigned long from, unsigned long limit) {
+  pthread_mutex_lock(&roster.lock);
+  send_roster_page(client, "", FRAME_ROSTER, roster.order, roster.count, from,
+    limit);
+  pthread_mutex_unlock(&roster.lock);
+}
+
+/* Sends a follower the changes since its cursor, or when they have left
+   the ring, the whole roster again. With the lock held. */
+static void
+send_roster_changes(int client) {
+  char chunk[LARGE_BUFFER_SIZE], outgoing[MAX_PACKAGE_LENGTH];
+  unsigned char count[MAX_VARINT_LENGTH];
+  struct RosterChange * change;
+  unsigned long i, from;
+  size_t used, size, n;
+  int binary;
+  binary = connections.state[client].binary;
+  from = connections.data[client].roster_cursor;
+  connections.data[client].roster_cursor = roster.changed;
+  if (roster.changed - from > ROSTER_CHANGES) {
+    send_roster_page(client, "=", FRAME_ROSTER_RESET, roster.order,
+      roster.count, 0, ULONG_MAX);
+    return;
+  }
+  if (binary) {
+    n = put_varint(count, roster.changed - from);
+    for (size = n, i = from; i < roster.changed; ++i) {
+      size += 2 + roster.changes[i % ROSTER_CHANGES].length;
+    }
+    send_frame_header(client, FRAME_ROSTER_CHANGES, size);
+    send_bytes(client, (char *) count, n);
+  } else {
+    sprintf(outgoing, "*%lu", roster.changed - from);
+    send_package(client, outgoing);
+  }
+  for (used = 0, i = from; i < roster.changed; ++i) {
+    if (used > sizeof(chunk) - MAX_NICK_LENGTH - 3) {
+      send_bytes(client, chunk, used);
+      used = 0;
+    }
+    change = &roster.changes[i % ROSTER_CHANGES];
+    if (binary) {
+      chunk[used++] = change->line[0];
+      chunk[used++] = change->length;
+      memcpy(chunk + used, change->line + 1, change->length);
+      used += change->length;
+    } else {
+      memcpy(chunk + used, change->line, change->length + 3);
+      used += change->length + 3;
+    }
+  }
+  send_bytes(client, chunk, used);
+}
+
+/* A new follower gets the whole roster and the changes after it. */
+static void
+follow_roster(int client) {
+  struct ConnectionData * data;
+  data = &connections.data[client];
+  if (connections.state[client].following) return;
+  connections.state[client].following = 1;
+  pthread_mutex_lock(&roster.lock);
+  send_roster_page(client, "=", FRAME_ROSTER_RESET, roster.order,
+    roster.count, 0, ULONG_MAX);
+  data->roster_cursor = roster.changed;
+  pthread_mutex_unlock(&roster.lock);
+  data->previous_follower = 0;
+  data->next_follower = followers.first;
+  if (followers.first) {
+    connections.data[followers.first].previous_follower = client;
+  }
+  followers.first = client;
+}
+
+static void
+unfollow_roster(int client) {
+  struct ConnectionData * data;
+  data = &connections.data[client];
+  if (!connections.state[client].following) return;
+  connections.state[client].following = 0;
+  if (data->previous_follower) {
+    connections.data[data->previous_follower].next_follower =
+      data->next_follower;
+  } else {
+    followers.first = data->next_follower;
+  }
+  if (data->next_follower) {
+    connections.data[data->next_follower].previous_follower =
+      data->previous_follower;
+  }
+}
+
+static void
+push_to_followers(void) {
+  int client;
+  struct ConnectionState * state;
+  pthread_mutex_lock(&roster.lock);
+  for (client = followers.first; client;
+      client = connections.data[client].next_follower) {
+    state = &connections.state[client];
+    if (state->closed || state->paused) continue;
+    if (connections.data[client].roster_cursor == roster.changed) continue;
+    send_roster_changes(client);
+  }
+  followers.pushed = roster.changed;
+  pthread_mutex_unlock(&roster.lock);
+  followers.lagging = 0;
+}
+
+static void
+init_rooms(void) {
+  unsigned long size;
+  pthread_mutex_init(&rooms.lock, NULL);
+  for (size = 1; size < 2 * (unsigned long) config.max_rooms; size *= 2) { }
+  rooms.table = calloc(size, sizeof(rooms.table[0]));
+  rooms.numbers = malloc((config.max_rooms + 1) * sizeof(rooms.numbers[0]));
+  if (!rooms.table || !rooms.numbers) die("Out of memory");
+  rooms.mask = size - 1;
+}
+
+/* FNV-1a */
+static unsigned long
+hash_room_name(const char * name, size_t length) {
+  unsigned long hash;
+  size_t i;
+  hash = 2166136261UL;
+  for (i = 0; i < length; ++i) {
+    hash = (hash ^ (unsigned char) name[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+/* Finds the room for a join, making it unless there are config.max_rooms
+   already. Returns -2 when there are, -3 out of memory. */
+static int
+open_room(const char * name, size_t length, struct Room ** opened) {
+  struct Room * room;
+  unsigned long i, hash;
+  int result;
+  hash = hash_room_name(name, length);
+  result = 0;
+  pthread_mutex_lock(&rooms.lock);
+  for (i = hash & rooms.mask; (room = rooms.table[i]);
+      i = (i + 1) & rooms.mask) {
+    if (room->length == length && !memcmp(room->name, name, length)) {
+      goto found;
+    }
+  }
+  result = -2;
+  if (rooms.count == config.max_rooms) goto unlock;
+  result = -3;
+  room = calloc(1, sizeof(*room));
+  if (!room) goto unlock;
+  if (-1 == init_history(&room->history, config.room_history_length,
+      MIN(config.room_history_length, HISTORY_BLOCK_LENGTH))) {
+    free(room);
+    goto unlock;
+  }
+  result = 0;
+  memcpy(room->name, name, length);
+  room->length = length;
+  room->hash = hash;
+  room->number = rooms.free_numbers ? rooms.numbers[--rooms.free_numbers]
+    : rooms.count + 1;
+  ++rooms.count;
+  pthread_mutex_init(&room->lock, NULL);
+  rooms.table[i] = room;
+found:
+  ++room->users;
+  *opened = room;
+unlock:
+  pthread_mutex_unlock(&rooms.lock);
+  return result;
+}
+
+/* Takes the room out of the table, moving back each one after it that
+   probing from its own slot would no longer reach. With the lock held. */
+static void
+remove_room(struct Room * room) {
+  unsigned long i, j, home;
+  for (i = room->hash & rooms.mask; rooms.table[i] != room;
+      i = (i + 1) & rooms.mask) {
+  }
+  rooms.table[i] = NULL;
+  for (j = (i + 1) & rooms.mask; rooms.table[j]; j = (j + 1) & rooms.mask) {
+    home = rooms.table[j]->hash & rooms.mask;
+    /* it stays unless the gap lies between its slot and where it is */
+    if (i <= j ? i < home && home <= j : i < home || home <= j) continue;
+    rooms.table[i] = rooms.table[j];
+    rooms.table[j] = NULL;
+    i = j;
+  }
+}
+
+/* Lets go of a room after a leave, and when that was its last user, of
+   its log and everything else. No worker has it among its local rooms by
+   then; the blocks of the log go the way of any other, so output still
+   holding them is safe. */
+static void
+close_room(struct Room * room) {
+  unsigned long i;
+  pthread_mutex_lock(&rooms.lock);
+  if (--room->users) {
+    pthread_mutex_unlock(&rooms.lock);
+    return;
+  }
+  remove_room(room);
+  rooms.numbers[rooms.free_numbers++] = room->number;
+  --rooms.count;
+  pthread_mutex_unlock(&rooms.lock);
+  for (i = 0; i < room->history.length; ++i) {
+    if (room->history.blocks[i]) {
+      release_history_block(room->history.blocks[i]);
+    }
+  }
+  free(room->history.blocks);
+  free(room->entries);
+  free(room->members);
+  pthread_mutex_destroy(&room->lock);
+  free(room);
+}
+
+static struct Membership *
+membership_of(int member) {
+  return &connections.data[member / MAX_MEMBERSHIPS]
+    .memberships[member % MAX_MEMBERSHIPS];
+}
+
+static struct Membership *
+find_membership(int client, const char * name, size_t length) {
+  struct Membership * membership;
+  int slot;
+  if (!connections.data[client].memberships) return NULL;
+  for (slot = 0; slot < MAX_MEMBERSHIPS; ++slot) {
+    membership = &connections.data[client].memberships[slot];
+    if (membership->room && membership->room->length == length &&
+        !memcmp(membership->room->name, name, length)) {
+      return membership;
+    }
+  }
+  return NULL;
+}
+
+/* Joins the room. Returns -1 when the name has a space, -2 when the
+   connection is in MAX_MEMBERSHIPS rooms or there are no more to be
+   made, -3 out of memory. */
+static int
+join_room(int client, const char * name, size_t length) {
+  struct ConnectionData * data;
+  struct Membership * membership;
+  struct LocalRoom * local;
+  struct Room * room;
+  int * entries;
+  struct Membership ** members;
+  int slot, member, capacity, result;
+  if (!length || MAX_ROOM_LENGTH < length || memchr(name, ' ', length)) {
+    return -1;
+  }
+  if (find_membership(client, name, length)) return 0;
+  data = &connections.data[client];
+  if (!data->memberships) {
+    data->memberships = calloc(MAX_MEMBERSHIPS, sizeof(data->memberships[0]));
+    if (!data->memberships) return -3;
+  }
+  if (!local_rooms.rooms) {
+    local_rooms.rooms = calloc(config.max_rooms + 1,
+      sizeof(local_rooms.rooms[0]));
+    if (!local_rooms.rooms) return -3;
+  }
+  for (slot = 0; slot < MAX_MEMBERSHIPS; ++slot) {
+    if (!data->memberships[slot].room) break;
+  }
+  if (MAX_MEMBERSHIPS == slot) return -2;
+  result = open_room(name, length, &room);
+  if (result) return result;
+  membership = &data->memberships[slot];
+  pthread_mutex_lock(&room->lock);
+  if (room->count == room->capacity) {
+    capacity = room->capacity ? room->capacity * 2 : CONNECTIONS_CHUNK;
+    entries = realloc(room->entries, capacity * sizeof(room->entries[0]));
+    if (entries) room->entries = entries;
+    members = !entries ? NULL
+      : realloc(room->members, capacity * sizeof(room->members[0]));
+    if (!members) {
+      pthread_mutex_unlock(&room->lock);
+      close_room(room);
+      return -3;
+    }
+    room->members = members;
+    room->capacity = capacity;
+  }
+  membership->room = room;
+  membership->position = room->count;
+  room->entries[room->count] = data->roster;
+  room->members[room->count++] = membership;
+  pthread_mutex_unlock(&room->lock);
+  membership->cursor = history_head(&room->history);
+  local = &local_rooms.rooms[room->number];
+  if (!local->first) {
+    local->room = room;
+    local->pushed = membership->cursor;
+    local->previous = 0;
+    local->next = local_rooms.first;
+    if (local_rooms.first) {
+      local_rooms.rooms[local_rooms.first].previous = room->number;
+    }
+    local_rooms.first = room->number;
+  }
+  member = client * MAX_MEMBERSHIPS + slot;
+  membership->previous = 0;
+  membership->next = local->first;
+  if (local->first) membership_of(local->first)->previous = member;
+  local->first = member;
+  return 0;
+}
+
+static void
+leave_room(struct Membership * membership) {
+  struct LocalRoom * local;
+  struct Room * room;
+  struct Membership * last;
+  room = membership->room;
+  pthread_mutex_lock(&room->lock);
+  last = room->members[--room->count];
+  room->entries[membership->position] = room->entries[room->count];
+  room->members[membership->position] = last;
+  last->position = membership->position;
+  pthread_mutex_unlock(&room->lock);
+  local = &local_rooms.rooms[room->number];
+  if (membership->previous) {
+    membership_of(membership->previous)->next = membership->next;
+  } else {
+    local->first = membership->next;
+  }
+  if (membership->next) {
+    membership_of(membership->next)->previous = membership->previous;
+  }
+  membership->room = NULL;
+  if (!local->first) {
+    if (local->previous) {
+      local_rooms.rooms[local->previous].next = local->next;
+    } else {
+      local_rooms.first = local->next;
+    }
+    if (local->next) {
+      local_rooms.rooms[local->next].previous = local->previous;
+    }
+  }
+  close_room(room);
+}
+
+static void
+leave_rooms(int client) {
+  struct ConnectionData * data;
+  int slot;
+  data = &connections.data[client];
+  if (!data->memberships) return;
+  for (slot = 0; slot < MAX_MEMBERSHIPS; ++slot) {
+    if (data->memberships[slot].room) {
+      leave_room(&data->memberships[slot]);
+    }
+  }
+  free(data->memberships);
+  data->memberships = NULL;
+}
+
+/* Whether some room here has messages its members have not been pushed. */
+static int
+rooms_behind(void) {
+  struct LocalRoom * local;
+  int number;
+  for (number = local_rooms.first; number; number = local->next) {
+    local = &local_rooms.rooms[number];
+    if (local->pushed != history_head(&local->room->history)) return 1;
+  }
+  return 0;
+}
+
+/* Subscribed members get the messages of their rooms like those of the
+   lobby, only rooms whose log has moved on are looked into. */
+static void
+push_to_rooms(void) {
+  struct LocalRoom * local;
+  struct Membership * membership;
+  struct ConnectionState * state;
+  unsigned long next;
+  int number, member, client;
+  for (number = local_rooms.first; number; number = local->next) {
+    local = &local_rooms.rooms[number];
+    next = history_head(&local->room->history);
+    if (local->pushed == next && !local_rooms.lagging) continue;
+    for (member = local->first; member; member = membership->next) {
+      membership = membership_of(member);
+      client = member / MAX_MEMBERSHIPS;
+      state = &connections.state[client];
+      if (!state->subscribed || state->closed || state->paused) continue;
+      if (membership->cursor >= next) continue;
+      membership->cursor = send_history(client, &local->room->history,
+        local->room, membership->cursor, 1);
+    }
+    local->pushed = next;
+  }
+  local_rooms.lagging = 0;
+}
+
+static void
+send_room_roster(int client, struct Room * room) {
+  pthread_mutex_lock(&room->lock);
+  pthread_mutex_lock(&roster.lock);
+  send_roster_page(client, "", FRAME_ROSTER, room->entries, room->count, 0,
+    ULONG_MAX);
+  pthread_mutex_unlock(&roster.lock);
+  pthread_mutex_unlock(&room->lock);
+}
+
+/* Adds up the stats of every worker that has started. */
+static void
+sum_stats(struct Stats * sum) {
+  struct Stats * stats;
+  size_t i, j, k;
+  memset(sum, 0, sizeof(*sum));
+  for (i = 0; i < (size_t) config.threads; ++i) {
+    stats = __atomic_load_n(&workers[i].stats, __ATOMIC_ACQUIRE);
+    if (!stats) continue;
+    for (j = 0; j < COUNTERS; ++j) {
+      sum->counters[j] += __atomic_load_n(&stats->counters[j],
+        __ATOMIC_RELAXED);
+    }
+    for (j = 0; j < HISTOGRAMS; ++j) {
+      for (k = 0; k < HISTOGRAM_BUCKETS; ++k) {
+        sum->histograms[j][k] += __atomic_load_n(&stats->histograms[j][k],
+          __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+/* Puts a stat into 'list' as a line or as binary fields, adding its bytes
+   to 'size'. -1 when out of memory. */
+static int
+put_stat(struct ListOfBuffers * list, size_t * size, const char * name,
+    unsigned long value, int binary) {
+  char outgoing[2 * MAX_STAT_NAME + MAX_VARINT_LENGTH + 24];
+  size_t length;
+  if (binary) {
+    outgoing[0] = length = strlen(name);
+    memcpy(outgoing + 1, name, length);
+    length += 1 + put_varint((unsigned char *) outgoing + 1 + length, value);
+  } else {
+    length = sprintf(outgoing, "%s %lu\r\n", name, value);
+  }
+  *size += length;
+  return put_bytes(list, outgoing, length);
+}
+
+/* Reports the counters summed over the workers, the backlog of the
+   connection asking and the CPU time of the whole process, then the
+   buckets of the histograms in use. */
+static void
+send_stats(int client) {
+  char name[2 * MAX_STAT_NAME], outgoing[MAX_PACKAGE_LENGTH];
+  unsigned char count[MAX_VARINT_LENGTH];
+  struct Stats sum;
+  struct ListOfBuffers lines;
+  struct rusage usage;
+  unsigned long n;
+  size_t i, j, size, length;
+  int binary, failed;
+  if (connections.state[client].closed) return;
+  binary = connections.state[client].binary;
+  if (-1 == getrusage(RUSAGE_SELF, &usage)) memset(&usage, 0, sizeof(usage));
+  sum_stats(&sum);
+  lines.first = lines.last = NULL;
+  size = failed = 0;
+  for (i = 0; i < COUNTERS; ++i) {
+    failed |= put_stat(&lines, &size, counter_names[i], sum.counters[i],
+      binary);
+  }
+  failed |= put_stat(&lines, &size, "connection_queued_bytes",
+    connections.state[client].queued, binary);
+  failed |= put_stat(&lines, &size, "cpu_microseconds",
+    (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000UL +
+    usage.ru_utime.tv_usec + usage.ru_stime.tv_usec, binary);
+  n = COUNTERS + 2;
+  for (i = 0; i < HISTOGRAMS; ++i) {
+    for (j = 0; j < HISTOGRAM_BUCKETS; ++j) {
+      if (!sum.histograms[i][j]) continue;
+      sprintf(name, "%.*s_below_%lu", MAX_STAT_NAME - 1, histogram_names[i],
+        1UL << j);
+      failed |= put_stat(&lines, &size, name, sum.histograms[i][j], binary);
+      ++n;
+    }
+  }
+  if (failed) {
+    release_buffers(&lines);
+    close_connection(client);
+    return;
+  }
+  if (binary) {
+    length = put_varint(count, n);
+    send_frame_header(client, FRAME_COUNTERS, length + size);
+    send_bytes(client, (char *) count, length);
+  } else {
+    sprintf(outgoing, "%lu", n);
+    send_package(client, outgoing);
+  }
+  if (connections.state[client].closed) {
+    release_buffers(&lines);
+    return;
+  }
+  send_list(client, &lines, size);
+}
+
+static int
+run_my_name_is(int client, char * nick, size_t length) {
+  /* a link from a peer has no entry */
+  if (MAX_NICK_LENGTH < length || !connections.data[client].roster) {
+    return -1;
+  }
+  strcpy(connections.data[client].nick, nick);
+  rename_in_roster(connections.data[client].roster,
+    connections.data[client].nick);
+  return 0;
+}
+
+static int
+run_folks(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+  send_roster(client, 0, ULONG_MAX);
+  return 0;
+}
+
+static int
+run_folks_page(int client, char * argument, size_t length) {
+  unsigned long from, limit;
   char * end;
-  unsigned long port;
-  short events;
-  init();
-  if (2 != argc) show_usage(argv[0]);
-  port = strtoul(argv[1], &end, 10);
-  if (*end) show_usage(argv[0]);
-  if (!port) die("port 0 is not allowed");
-  if (65535 < port) die("port is too big");
-  prepare_server(port);
+  from = strtoul(argument, &end, 10);
+  if (end == argument || ' ' != *end) return -1;
+  limit = strtoul(end + 1, &end, 10);
+  if (end != argument + length) return -1;
+  send_roster(client, from, limit);
+  return 0;
+}
+
+static int
+run_binary_folks_page(int client, char * argument, size_t length) {
+  unsigned long from, limit;
+  int n, m;
+  n = get_varint((unsigned char *) argument, length, &from);
+  if (n <= 0) return -1;
+  m = get_varint((unsigned char *) argument + n, length - n, &limit);
+  if (m <= 0 || (size_t) (n + m) != length) return -1;
+  send_roster(client, from, limit);
+  return 0;
+}
+
+static int
+run_folks_count(int client, char * argument, size_t length) {
+  char outgoing[MAX_PACKAGE_LENGTH];
+  unsigned char count[MAX_VARINT_LENGTH];
+  int n;
+  (void) argument; (void) length;
+  pthread_mutex_lock(&roster.lock);
+  n = roster.count;
+  pthread_mutex_unlock(&roster.lock);
+  if (connections.state[client].binary) {
+    send_frame(client, FRAME_ROSTER_SIZE, count, put_varint(count, n));
+  } else {
+    sprintf(outgoing, "%d", n);
+    send_package(client, outgoing);
+  }
+  return 0;
+}
+
+static int
+run_send(int client, char * message, size_t length) {
+  if (MAX_MESSAGE_LENGTH < length) return -1;
+  add_to_history(&lobby, connections.data[client].nick, message, 0);
+  return 0;
+}
+
+static int
+run_new(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+  connections.data[client].cursor = send_history(client, &lobby, NULL,
+    connections.data[client].cursor, 0);
+  return 0;
+}
+
+static int
+run_new_since(int client, char * argument, size_t length) {
+  struct timespec since;
+  char * end;
+  since.tv_sec = strtol(argument, &end, 10);
+  since.tv_nsec = 0;
+  if (!length || end != argument + length) return -1;
+  connections.data[client].cursor = send_history(client, &lobby, NULL,
+    find_in_history(&lobby, since), 0);
+  return 0;
+}
+
+static int
+run_binary_new_since(int client, char * argument, size_t length) {
+  struct timespec since;
+  unsigned long seconds;
+  if ((int) length != get_varint((unsigned char *) argument, length,
+      &seconds)) {
+    return -1;
+  }
+  since.tv_sec = seconds;
+  since.tv_nsec = 0;
+  connections.data[client].cursor = send_history(client, &lobby, NULL,
+    find_in_history(&lobby, since), 0);
+  return 0;
+}
+
+/* One the server has no room or no memory for is refused, not the
+   connection. */
+static int
+run_join(int client, char * room, size_t length) {
+  char outgoing[MAX_PACKAGE_LENGTH];
+  if (!connections.data[client].roster) return -1;
+  switch (join_room(client, room, length)) {
+  case -2:
+    sprintf(outgoing, "no room for %s", room);
+    break;
+  case -3:
+    sprintf(outgoing, "out of memory for %s", room);
+    break;
+  default:
+    return 0;
+  }
+  send_error(client, outgoing);
+  return 0;
+}
+
+static int
+run_leave(int client, char * room, size_t length) {
+  struct Membership * membership;
+  membership = find_membership(client, room, length);
+  if (membership) leave_room(membership);
+  return 0;
+}
+
+/* Only members post to a room. */
+static int
+run_post(int client, char * argument, size_t length) {
+  struct Membership * membership;
+  char * message;
+  message = memchr(argument, ' ', length);
+  if (!message) return -1;
+  membership = find_membership(client, argument, message - argument);
+  if (!membership) return -1;
+  ++message;
+  if (MAX_MESSAGE_LENGTH < length - (message - argument)) return -1;
+  add_to_history(&membership->room->history, connections.data[client].nick,
+    message, 0);
+  return 0;
+}
+
+static int
+run_new_in(int client, char * room, size_t length) {
+  struct Membership * membership;
+  membership = find_membership(client, room, length);
+  if (!membership) return -1;
+  membership->cursor = send_history(client, &membership->room->history, NULL,
+    membership->cursor, 0);
+  return 0;
+}
+
+static int
+run_folks_in(int client, char * room, size_t length) {
+  struct Membership * membership;
+  membership = find_membership(client, room, length);
+  if (!membership) return -1;
+  send_room_roster(client, membership->room);
+  return 0;
+}
+
+static int
+run_subscribe(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+  subscribe(client);
+  return 0;
+}
+
+static int
+run_unsubscribe(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+  unsubscribe(client);
+  return 0;
+}
+
+static int
+run_subscribe_folks(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+  follow_roster(client);
+  return 0;
+}
+
+static int
+run_unsubscribe_folks(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+  unfollow_roster(client);
+  return 0;
+}
+
+static int
+run_stats(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+  send_stats(client);
+  return 0;
+}
+
+/* Acknowledged in text, everything after is binary either way. */
+static int
+run_binary(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+  send_package(client, PACKAGE_BINARY);
+  connections.state[client].binary = 1;
+  return 0;
+}
+
+static int
+run_compress(int client, char * argument, size_t length) {
+  (void) argument; (void) length;
+#ifdef USE_ZLIB
+  send_package(client, PACKAGE_COMPRESS " deflate");
+  connections.state[client].compressed = 1;
+#else
+  send_package(client, PACKAGE_COMPRESS " none");
+#endif
+  return 0;
+}
+
+/* Finds the peer of a name, or makes it as missing only its messages from
+   'next' on. NULL when there are MAX_PEERS already. With the federation
+   lock held. */
+static struct Peer *
+find_peer(const char * name, size_t length, unsigned long next) {
+  struct Peer * peer;
+  int i;
+  for (i = 0; i < federation.peer_count; ++i) {
+    peer = &federation.peers[i];
+    if (length == strlen(peer->name) && !memcmp(peer->name, name, length)) {
+      return peer;
+    }
+  }
+  if (MAX_PEERS == federation.peer_count) return NULL;
+  peer = &federation.peers[federation.peer_count++];
+  memcpy(peer->name, name, length);
+  peer->name[length] = '\0';
+  peer->next = next;
+  return peer;
+}
+
+/* With the federation lock held. */
+static void
+forget_folks(struct Peer * peer) {
+  while (peer->count) leave_roster(peer->folks[--peer->count].entry);
+}
+
+/* The peer a connection is its latest link of, NULL for one that is not. */
+static struct Peer *
+linked_peer(int client) {
+  struct Peer * peer;
+  peer = connections.data[client].peer;
+  if (!peer || connections.data[client].link !=
+      __atomic_load_n(&peer->link, __ATOMIC_SEQ_CST)) {
+    return NULL;
+  }
+  return peer;
+}
+
+/* Whether the connection comes from the host of one of the peers. */
+static int
+from_peer_host(int client) {
+  struct sockaddr_in address;
+  socklen_t length;
+  int i;
+  length = sizeof(address);
+  if (-1 == getpeername(connections.sockets[client].fd,
+      (struct sockaddr *) &address, &length) ||
+      AF_INET != address.sin_family) {
+    return 0;
+  }
+  for (i = 0; i < federation.address_count; ++i) {
+    if (address.sin_addr.s_addr == federation.addresses[i].s_addr) return 1;
+  }
+  return 0;
+}
+
+/* Makes the connection the link of a peer, in place of the one before, and
+   takes it out of the roster, if it comes from the host of a peer. The
+   reply is where the last link stopped, or for a peer new here its next
+   message, so what it retains is not replayed; 0 for one numbering from
+   lower than that, which lost its history. */
+static int
+run_peer(int client, char * argument, size_t length) {
+  char outgoing[MAX_PACKAGE_LENGTH];
+  struct ConnectionData * data;
+  struct Peer * peer;
+  unsigned long next, wanted;
+  char * space, * end;
+  (void) length;
+  data = &connections.data[client];
+  space = strrchr(argument, ' ');
+  if (data->peer || !space || space == argument ||
+      MAX_PEER_NAME < space - argument || !from_peer_host(client)) {
+    return -1;
+  }
+  next = strtoul(space + 1, &end, 10);
+  if (end == space + 1 || *end) return -1;
+  pthread_mutex_lock(&federation.lock);
+  peer = find_peer(argument, space - argument, next);
+  if (!peer) {
+    pthread_mutex_unlock(&federation.lock);
+    return -1;
+  }
+  forget_folks(peer);
+  wanted = __atomic_load_n(&peer->next, __ATOMIC_SEQ_CST);
+  if (wanted > next) wanted = 0;
+  __atomic_store_n(&peer->next, wanted, __ATOMIC_SEQ_CST);
+  data->link = __atomic_add_fetch(&peer->link, 1, __ATOMIC_SEQ_CST);
+  data->peer = peer;
+  pthread_mutex_unlock(&federation.lock);
+  leave_roster(data->roster);
+  data->roster = 0;
+  sprintf(outgoing, "%lu", wanted);
+  send_package(client, outgoing);
+  return 0;
+}
+
+static int
+run_at(int client, char * argument, size_t length) {
+  struct Peer * peer;
+  unsigned long at;
+  char * end;
+  if (!(peer = linked_peer(client))) return -1;
+  at = strtoul(argument, &end, 10);
+  if (end == argument || end != argument + length) return -1;
+  __atomic_store_n(&peer->at, at, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+/* Stores a message of a peer unless it has been already, by an earlier
+   link. */
+static int
+run_relay(int client, char * argument, size_t length) {
+  char nick[MAX_NICK_LENGTH + 1];
+  struct Peer * peer;
+  unsigned long nick_length, sequence;
+  char * end;
+  if (!(peer = linked_peer(client))) return -1;
+  nick_length = strtoul(argument, &end, 10);
+  if (end == argument || ' ' != *end || MAX_NICK_LENGTH < nick_length ||
+      (size_t) (argument + length - end) < nick_length + 2) {
+    return -1;
+  }
+  memcpy(nick, end + 1, nick_length);
+  nick[nick_length] = '\0';
+  end += nick_length + 1;
+  if (' ' != *end || MAX_MESSAGE_LENGTH < argument + length - end - 1) {
+    return -1;
+  }
+  sequence = __atomic_fetch_add(&peer->at, 1, __ATOMIC_SEQ_CST);
+  if (sequence < __atomic_load_n(&peer->next, __ATOMIC_SEQ_CST)) return 0;
+  __atomic_store_n(&peer->next, sequence + 1, __ATOMIC_SEQ_CST);
+  add_to_history(&lobby, nick, end + 1, 1);
+  count(COUNTER_RELAYED_MESSAGES, 1);
+  return 0;
+}
+
+static int
+run_joined(int client, char * nick, size_t length) {
+  struct Peer * peer;
+  int entry;
+  if (MAX_NICK_LENGTH < length) return -1;
+  pthread_mutex_lock(&federation.lock);
+  if (!(peer = linked_peer(client))) {
+    pthread_mutex_unlock(&federation.lock);
+    return -1;
+  }
+  /* past the connection limit the nick goes unlisted */
+  entry = join_roster(nick, 1);
+  if (-1 != entry) {
+    if (peer->count == peer->capacity) {
+      peer->capacity = peer->capacity ? peer->capacity * 2
+        : CONNECTIONS_CHUNK;
+      peer->folks = grow(peer->folks,
+        peer->capacity * sizeof(peer->folks[0]));
+    }
+    peer->folks[peer->count].entry = entry;
+    strcpy(peer->folks[peer->count++].nick, nick);
+  }
+  pthread_mutex_unlock(&federation.lock);
+  return 0;
+}
+
+/* Entries of the same nick are alike, any of them goes. */
+static int
+run_left(int client, char * nick, size_t length) {
+  struct Peer * peer;
+  int i;
+  (void) length;
+  pthread_mutex_lock(&federation.lock);
+  if (!(peer = linked_peer(client))) {
+    pthread_mutex_unlock(&federation.lock);
+    return -1;
+  }
+  for (i = peer->count - 1; i >= 0; --i) {
+    if (strcmp(peer->folks[i].nick, nick)) continue;
+    leave_roster(peer->folks[i].entry);
+    peer->folks[i] = peer->folks[--peer->count];
+    break;
+  }
+  pthread_mutex_unlock(&federation.lock);
+  return 0;
+}
+
+/* Drops the folks of a link closing, unless a later one took over. */
+static void
+unlink_peer(int client) {
+  pthread_mutex_lock(&federation.lock);
+  if (linked_peer(client)) forget_folks(connections.data[client].peer);
+  pthread_mutex_unlock(&federation.lock);
+}
+
+static void
+put_link_bytes(struct Link * link, const char * data, size_t size) {
+  if (link->used + size > link->capacity) {
+    link->capacity = MAX(link->capacity * 2, link->used + size);
+    link->batch = grow(link->batch, link->capacity);
+  }
+  memcpy(link->batch + link->used, data, size);
+  link->used += size;
+}
+
+/* Batches the lobby messages of local clients stored since the last call,
+   taking the blocks like write_journal(). */
+static void
+forward_messages(struct Link * link) {
+  char line[MAX_PACKAGE_LENGTH];
+  struct HistoryBlock * block;
+  unsigned long next, at, base, end, position;
+  unsigned nick, message;
+  next = history_head(&lobby);
+  while (link->cursor < next) {
+    at = link->cursor;
+    base = at - at % HISTORY_BLOCK_LENGTH;
+    end = MIN(base + HISTORY_BLOCK_LENGTH, next);
+    block = history_block(&lobby, at);
+    if (-1 == hold_history_block(block)) block = NULL;
+    if (block && block->first != base) {
+      release_history_block(block);
+      block = NULL;
+    }
+    if (!block) {
+      /* the writers lapped the link, what it missed is gone */
+      link->cursor = history_first(&lobby, history_head(&lobby));
+      continue;
+    }
+    for (; at < end; ++at) {
+      position = at - base;
+      if (block->relayed[position]) continue;
+      if (at != link->expected) {
+        sprintf(line, "%s%lu\r\n", PACKAGE_BEGIN_AT, at);
+        put_link_bytes(link, line, strlen(line));
+      }
+      /* the nick and the text of "[hh:mm:ss] nick: text\r\n" */
+      nick = block->offset[position] + TIMESTAMP_LENGTH + 1;
+      message = nick + block->nick_length[position] + 2;
+      sprintf(line, "%s%u ", PACKAGE_BEGIN_RELAY,
+        (unsigned) block->nick_length[position]);
+      put_link_bytes(link, line, strlen(line));
+      put_link_bytes(link, block->bytes + nick, block->nick_length[position]);
+      put_link_bytes(link, " ", 1);
+      put_link_bytes(link, block->bytes + message,
+        block->offset[position + 1] - message);
+      link->expected = at + 1;
+      count(COUNTER_FORWARDED_MESSAGES, 1);
+    }
+    release_history_block(block);
+    link->cursor = end;
+  }
+}
+
+static void
+put_roster_line(struct Link * link, char sign, const char * line,
+    size_t length) {
+  if ('+' == sign) {
+    put_link_bytes(link, PACKAGE_BEGIN_JOINED,
+      sizeof(PACKAGE_BEGIN_JOINED) - 1);
+  } else {
+    put_link_bytes(link, PACKAGE_BEGIN_LEFT, sizeof(PACKAGE_BEGIN_LEFT) - 1);
+  }
+  put_link_bytes(link, line, length + 2);
+}
+
+/* Batches the local folks as joins and follows the roster from there. */
+static void
+put_link_folks(struct Link * link) {
+  struct RosterEntry * entry;
+  int i;
+  pthread_mutex_lock(&roster.lock);
+  for (i = 0; i < roster.count; ++i) {
+    entry = &roster.entries[roster.order[i]];
+    if (!entry->remote) put_roster_line(link, '+', entry->line, entry->length);
+  }
+  link->roster_cursor = roster.changed;
+  pthread_mutex_unlock(&roster.lock);
+}
+
+/* Batches the joins and leaves of local clients since the last call, -1
+   when the link fell too far behind to know them. */
+static int
+forward_roster_changes(struct Link * link) {
+  struct RosterChange * change;
+  pthread_mutex_lock(&roster.lock);
+  if (roster.changed - link->roster_cursor > ROSTER_CHANGES) {
+    pthread_mutex_unlock(&roster.lock);
+    return -1;
+  }
+  for (; link->roster_cursor < roster.changed; ++link->roster_cursor) {
+    change = &roster.changes[link->roster_cursor % ROSTER_CHANGES];
+    if (change->remote) continue;
+    put_roster_line(link, change->line[0], change->line + 1, change->length);
+  }
+  pthread_mutex_unlock(&roster.lock);
+  return 0;
+}
+
+static int
+close_link(struct Link * link) {
+  close(link->fd);
+  link->fd = -1;
+  return -1;
+}
+
+static int
+write_link(struct Link * link, const char * data, size_t size) {
+  ssize_t written;
+  while (size) {
+    written = write(link->fd, data, size);
+    if (-1 == written) {
+      if (EINTR == errno) continue;
+      return close_link(link);
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+static int
+flush_link(struct Link * link) {
+  size_t used;
+  used = link->used;
+  link->used = 0;
+  return write_link(link, link->batch, used);
+}
+
+/* Connects to the peer and greets it, -1 if it cannot be reached or gives
+   no answer within LINK_TIMEOUT milliseconds. Blocks, so it is called
+   offline. */
+static int
+open_link(struct Link * link) {
+  char greeting[MAX_PEER_NAME + 32], reply[32];
+  struct addrinfo hints, * addresses, * address;
+  struct pollfd answer;
+  unsigned long head, wanted;
+  size_t got;
+  ssize_t n;
+  char * end;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(link->host, link->port, &hints, &addresses)) return -1;
+  for (address = addresses; address; address = address->ai_next) {
+    link->fd = socket(address->ai_family, address->ai_socktype,
+      address->ai_protocol);
+    if (-1 == link->fd) continue;
+    if (!connect(link->fd, address->ai_addr, address->ai_addrlen)) break;
+    close_link(link);
+  }
+  freeaddrinfo(addresses);
+  if (-1 == link->fd) return -1;
+  /* a link goes on without it */
+  set_socket_option(link->fd, IPPROTO_TCP, TCP_NODELAY, 1);
+  head = history_head(&lobby);
+  sprintf(greeting, "%s%s %lu\r\n", PACKAGE_BEGIN_PEER, federation.name, head);
+  if (-1 == write_link(link, greeting, strlen(greeting))) return -1;
+  answer.fd = link->fd;
+  answer.events = POLLIN;
+  for (got = 0; !memchr(reply, '\n', got); got += n) {
+    if (sizeof(reply) - 1 == got || 1 != poll(&answer, 1, LINK_TIMEOUT) ||
+        0 >= (n = read(link->fd, reply + got, sizeof(reply) - 1 - got))) {
+      return close_link(link);
+    }
+  }
+  reply[got] = '\0';
+  wanted = strtoul(reply, &end, 10);
+  if (end == reply || '\r' != *end) return close_link(link);
+  link->cursor = MAX(MIN(wanted, head),
+    history_first(&lobby, history_head(&lobby)));
+  link->expected = ULONG_MAX;
+  link->used = 0;
+  put_link_folks(link);
+  return 0;
+}
+
+/* A link thread sleeps like the journal writer, woken for new messages and
+   roster changes, or by the peer closing the link. It counts as reading
+   the ring only while it batches messages. While the peer is away it tries
+   again every LINK_RETRY milliseconds, and it links anew when it falls
+   behind the roster, so the peer gets the folks again. */
+static void *
+run_link(void * argument) {
+  struct pollfd events[2];
+  struct Link * link;
+  char discarded[64];
+  link = argument;
+  worker = link->worker;
+  __atomic_store_n(&worker->stats, &stats, __ATOMIC_RELEASE);
+  events[0].fd = worker->wakeup[0];
+  events[0].events = POLLIN;
+  events[1].events = POLLIN;
+  link->fd = -1;
+  while (!__atomic_load_n(&upgrade.requested, __ATOMIC_SEQ_CST)) {
+    if (-1 == link->fd && -1 == open_link(link)) {
+      poll(NULL, 0, LINK_RETRY);
+      continue;
+    }
+    __atomic_store_n(&worker->wanted, 1, __ATOMIC_SEQ_CST);
+    go_online();
+    forward_messages(link);
+    go_offline();
+    if (-1 == forward_roster_changes(link)) {
+      close_link(link);
+      continue;
+    }
+    if (-1 == flush_link(link)) continue;
+    if (link->cursor != history_head(&lobby) ||
+        link->roster_cursor != roster_head()) {
+      continue;
+    }
+    events[1].fd = link->fd;
+    if (-1 == poll(events, 2, -1) && EINTR != errno) {
+      die("'poll' failed: %s", system_error());
+    }
+    drain_wakeup();
+    if (events[1].revents &&
+        0 >= read(link->fd, discarded, sizeof(discarded))) {
+      close_link(link);
+    }
+  }
+  if (-1 != link->fd) close_link(link);
+  while (1) pause();
+  return NULL;
+}
+
+/* A command is a whole package, or when it takes an argument, the start of
+   one. Busy commands come first. 'limit' is the class of token bucket it
+   takes from, if any. 'frame' is the type of the binary frame for it, whose
+   argument is taken by 'run_frame' if it differs. */
+struct Command {
+  const char * name;
+  size_t length;
+  int argument;
+  int limit;
+  int (* run)(int client, char * argument, size_t length);
+  int frame;
+  int (* run_frame)(int client, char * argument, size_t length);
+};
+
+#define COMMAND(name, argument, limit, run, frame, run_frame) \
+  { name, sizeof(name) - 1, argument, limit, run, frame, run_frame }
+
+static const struct Command commands[] = {
+  COMMAND(PACKAGE_BEGIN_SEND, 1, LIMIT_SEND, run_send, FRAME_SEND, NULL),
+  COMMAND(PACKAGE_BEGIN_POST, 1, LIMIT_SEND, run_post, FRAME_POST, NULL),
+  COMMAND(PACKAGE_BEGIN_RELAY, 1, LIMIT_RELAY, run_relay, 0, NULL),
+  COMMAND(PACKAGE_NEW, 0, LIMIT_QUERY, run_new, FRAME_NEW, NULL),
+  COMMAND(PACKAGE_BEGIN_NEW_IN, 1, LIMIT_QUERY, run_new_in, FRAME_NEW_IN,
+    NULL),
+  COMMAND(PACKAGE_BEGIN_NEW_SINCE, 1, LIMIT_QUERY, run_new_since,
+    FRAME_NEW_SINCE, run_binary_new_since),
+  COMMAND(PACKAGE_FOLKS, 0, LIMIT_QUERY, run_folks, FRAME_FOLKS, NULL),
+  COMMAND(PACKAGE_FOLKS_COUNT, 0, LIMIT_QUERY, run_folks_count,
+    FRAME_FOLKS_COUNT, NULL),
+  COMMAND(PACKAGE_BEGIN_FOLKS_IN, 1, LIMIT_QUERY, run_folks_in,
+    FRAME_FOLKS_IN, NULL),
+  COMMAND(PACKAGE_BEGIN_FOLKS_PAGE, 1, LIMIT_QUERY, run_folks_page,
+    FRAME_FOLKS_PAGE, run_binary_folks_page),
+  COMMAND(PACKAGE_BEGIN_MY_NAME_IS, 1, LIMIT_ROSTER, run_my_name_is,
+    FRAME_MY_NAME_IS, NULL),
+  COMMAND(PACKAGE_BEGIN_JOIN, 1, LIMIT_ROSTER, run_join, FRAME_JOIN, NULL),
+  COMMAND(PACKAGE_BEGIN_LEAVE, 1, LIMIT_ROSTER, run_leave, FRAME_LEAVE, NULL),
+  COMMAND(PACKAGE_SUBSCRIBE, 0, LIMIT_QUERY, run_subscribe, FRAME_SUBSCRIBE,
+    NULL),
+  COMMAND(PACKAGE_UNSUBSCRIBE, 0, LIMIT_QUERY, run_unsubscribe,
+    FRAME_UNSUBSCRIBE, NULL),
+  COMMAND(PACKAGE_SUBSCRIBE_FOLKS, 0, LIMIT_QUERY, run_subscribe_folks,
+    FRAME_SUBSCRIBE_FOLKS, NULL),
+  COMMAND(PACKAGE_UNSUBSCRIBE_FOLKS, 0, LIMIT_QUERY, run_unsubscribe_folks,
+    FRAME_UNSUBSCRIBE_FOLKS, NULL),
+  COMMAND(PACKAGE_STATS, 0, LIMIT_QUERY, run_stats, FRAME_STATS, NULL),
+  COMMAND(PACKAGE_BINARY, 0, 0, run_binary, 0, NULL),
+  COMMAND(PACKAGE_COMPRESS, 0, 0, run_compress, 0, NULL),
+  COMMAND(PACKAGE_BEGIN_AT, 1, 0, run_at, 0, NULL),
+  COMMAND(PACKAGE_BEGIN_JOINED, 1, LIMIT_RELAY, run_joined, 0, NULL),
+  COMMAND(PACKAGE_BEGIN_LEFT, 1, LIMIT_RELAY, run_left, 0, NULL),
+  COMMAND(PACKAGE_BEGIN_PEER, 1, LIMIT_ROSTER, run_peer, 0, NULL)
+};
+
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+typedef char commands_have_histograms[COMMANDS <= MAX_COMMANDS ? 1 : -1];
+
+static long
+nanoseconds_since(struct timespec start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) * 1000000000L +
+    now.tv_nsec - start.tv_nsec;
+}
+
+/* Names the histograms of the commands after them. */
+static void
+init_stats(void) {
+  char * name;
+  size_t i, length;
+  for (i = 0; i < COMMANDS; ++i) {
+    name = histogram_names[HISTOGRAM_COMMAND + i];
+    sprintf(name, "command_ns_%s", commands[i].name);
+    for (length = strlen(name); ' ' == name[length - 1]; --length) {
+      name[length - 1] = '\0';
+    }
+    for (; *name; ++name) {
+      if (' ' == *name) *name = '_';
+    }
+  }
+}
+
+/* Runs the command with 'run' and accounts for the time it took. One over
+   its limit is held back, unparsed, until the next tick. */
+static int
+run_command(int client, const struct Command * command,
+    int (* run)(int client, char * argument, size_t length),
+    char * argument, size_t length) {
+  struct timespec start;
+  int result;
+  if (command->limit && -1 == take_token(client, command->limit)) {
+    throttle(client);
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  result = run(client, argument, length);
+  record(HISTOGRAM_COMMAND + (command - commands), nanoseconds_since(start));
+  count(COUNTER_COMMANDS, 1);
+  return result;
+}
+
+/* 'package' is NUL terminated, 'length' bytes long. */
+static int
+process_new_package(int client, char * package, size_t length) {
+  const struct Command * command;
+  for (command = commands; command < commands + COMMANDS; ++command) {
+    if (command->argument ? length < command->length
+        : length != command->length) {
+      continue;
+    }
+    if (memcmp(package, command->name, command->length)) continue;
+    return run_command(client, command, command->run,
+      package + command->length, length - command->length);
+  }
+  return -1;
+}
+
+/* Finds the next "\r\n" of the package starting at 'begin', looking from
+   'from' on. */
+static char *
+find_end_of_package(char * begin, char * from, char * end) {
+  char * newline;
+  while ((newline = memchr(from, '\n', end - from))) {
+    if (newline > begin && '\r' == newline[-1]) return newline - 1;
+    from = newline + 1;
+  }
+  return NULL;
+}
+
+/* 'frame' is 'length' bytes, its type and argument. The argument is copied
+   aside and NUL terminated like a text one. One for a text handler must not
+   hold what a text package could not. */
+static int
+process_new_frame(int client, char * frame, size_t length) {
+  char argument[MAX_FRAME_LENGTH];
+  const struct Command * command;
+  for (command = commands; command < commands + COMMANDS; ++command) {
+    if (command->frame && command->frame == (unsigned char) frame[0]) break;
+  }
+  if (command == commands + COMMANDS) return -1;
+  memcpy(argument, frame + 1, --length);
+  argument[length] = '\0';
+  if (command->run_frame) {
+    return run_command(client, command, command->run_frame, argument, length);
+  }
+  if (memchr(argument, '\0', length) ||
+      find_end_of_package(argument, argument, argument + length)) {
+    return -1;
+  }
+  return run_command(client, command, command->run, argument, length);
+}
+
+/* Runs every complete package or frame in the buffer in one pass. The
+   search for the end of a package goes on from where the last one stopped,
+   and only a package left incomplete or held back is moved to the
+   front. */
+static int
+process_new_data(int client) {
+  struct Buffer * buffer;
+  char * begin, * end, * package, * end_of_package;
+  unsigned long length;
+  int binary, header, result;
+  buffer = connections.data[client].input;
+  if (!buffer) return 0;
+  begin = buffer->data;
+  end = buffer->data + buffer->used;
   while (1) {
-    if (-1 == poll(connections.sockets, connections.length, -1)) {
-      die("'poll' failed: %s", system_error());
+    binary = connections.state[client].binary;
+    if (binary) {
+      header = get_varint((unsigned char *) begin, end - begin, &length);
+      if (-1 == header || (header && (!length || MAX_FRAME_LENGTH < length))) {
+        return -1;
+      }
+      if (!header || (unsigned long) (end - begin - header) < length) break;
+      package = begin + header;
+      end_of_package = package + length;
+    } else {
+      end_of_package = find_end_of_package(begin,
+        MAX(begin, buffer->data + buffer->scanned), end);
+      if (!end_of_package) {
+        if (end - begin >= MAX_PACKAGE_LENGTH - 1) return -1;
+        buffer->scanned = buffer->used;
+        break;
+      }
+      package = begin;
+      length = end_of_package - begin;
+    }
+    if (connections.state[client].paused ||
+        connections.state[client].throttled) {
+      break;
+    }
+    if (pool.used >= pool.limit) {
+      wait_for_memory(client);
+      break;
+    }
+    if (binary) {
+      result = process_new_frame(client, package, length);
+    } else {
+      *end_of_package = '\0';
+      result = process_new_package(client, package, length);
+    }
+    if (-1 == result) return -1;
+    if (connections.state[client].closed) return -1;
+    /* a command held back stays, as it came */
+    if (connections.state[client].throttled) {
+      if (!binary) *end_of_package = '\r';
+      break;
+    }
+    begin = binary ? end_of_package : end_of_package + 2;
+  }
+  if (begin == buffer->data) return 0;
+  buffer->used -= begin - buffer->data;
+  buffer->scanned = buffer->scanned > (size_t) (begin - buffer->data)
+    ? buffer->scanned - (begin - buffer->data) : 0;
+  if (buffer->used) memmove(buffer->data, begin, buffer->used);
+  return 0;
+}
+
+static void
+handle_input(int client) {
+  struct ConnectionData * data;
+  int fd;
+  ssize_t received;
+  fd = connections.sockets[client].fd;
+  data = &connections.data[client];
+  /* Readiness may be edge-triggered, so read until the socket runs dry or
+     the connection gets held back; whoever lets it go on calls resume_input,
+     which drains the socket. The buffer goes back to the pool once all it
+     held has been processed. */
+  while (!connections.state[client].waiting &&
+      !connections.state[client].paused &&
+      !connections.state[client].throttled) {
+    if (!data->input && !(data->input = take_input_buffer())) {
+      goto close_connection;
+    }
+    received = recv(fd, data->input->data + data->input->used,
+      config.input_buffer - data->input->used, 0);
+    count(COUNTER_READ_CALLS, 1);
+    if (-1 == received) {
+      if (EINTR == errno) continue;
+      if (EWOULDBLOCK == errno || EAGAIN == errno) break;
+      goto close_connection;
+    }
+    if (!received) goto close_connection;
+    count(COUNTER_BYTES_IN, received);
+    connections.state[client].active = timers.now;
+    data->input->used += received;
+    if (-1 == process_new_data(client)) goto close_connection;
+  }
+  if (data->input && !data->input->used) release_input_buffer(client);
+  return;
+close_connection:
+  close_connection(client);
+}
+
+/* Runs the commands a held back connection has buffered and then reads
+   whatever it has sent meanwhile. */
+static void
+resume_input(int client) {
+  if (-1 == process_new_data(client)) close_connection(client);
+  else handle_input(client);
+}
+
+/* Gathers up to IOV_BATCH pending pieces per writev. A short write means
+   the socket buffer is full; the next POLLOUT resumes where it stopped. */
+static void
+handle_output(int client) {
+  struct iovec vector[IOV_BATCH];
+  struct LinkedBuffer * buffer;
+  struct ListOfBuffers * pending;
+  int fd, n;
+  ssize_t sent;
+  size_t size, left;
+  pending = &connections.state[client].pending_to_be_sent;
+  fd = connections.sockets[client].fd;
+  assert(pending->first);
+  record(HISTOGRAM_QUEUED, connections.state[client].queued);
+  while (pending->first) {
+    size = 0;
+    for (n = 0, buffer = pending->first; buffer && n < IOV_BATCH;
+        buffer = buffer->next, ++n) {
+      vector[n].iov_base = (char *) buffer->data + buffer->sent;
+      vector[n].iov_len = buffer->used - buffer->sent;
+      size += vector[n].iov_len;
+    }
+    sent = writev(fd, vector, n);
+    count(COUNTER_WRITE_CALLS, 1);
+    if (-1 == sent) {
+      if (EINTR == errno) continue;
+      if (EWOULDBLOCK == errno || EAGAIN == errno) break;
+      close_connection(client);
+      return;
+    }
+    connections.state[client].queued -= sent;
+    count(COUNTER_QUEUED_BYTES, -sent);
+    count(COUNTER_BYTES_OUT, sent);
+    for (left = sent; left; ) {
+      buffer = pending->first;
+      if (left < (size_t) (buffer->used - buffer->sent)) {
+        buffer->sent += left;
+        break;
+      }
+      left -= buffer->used - buffer->sent;
+      pending->first = buffer->next;
+      release_buffer(buffer);
+    }
+    if (!pending->first) pending->last = NULL;
+    if ((size_t) sent < size) break;
+  }
+  update_interest(client);
+  if (connections.state[client].paused &&
+      connections.state[client].queued <= config.low_watermark) {
+    unpause_connection(client);
+    resume_input(client);
+  }
+}
+
+/* Lets connections that waited for memory go on once enough of it is
+   back. */
+static void
+resume_waiting(void) {
+  int client, next;
+  struct ConnectionState * state;
+  client = pool.waiting;
+  pool.waiting = 0;
+  for (; client; client = next) {
+    state = &connections.state[client];
+    next = state->next_waiting;
+    state->waiting = 0;
+    if (state->closed) continue;
+    update_interest(client);
+    if (!state->paused && !state->throttled) resume_input(client);
+  }
+}
+
+/* Lets the connections throttle() held back go on, a tick later. */
+static void
+resume_throttled(void) {
+  struct ConnectionState * state;
+  int client, next;
+  client = connections.throttled;
+  connections.throttled = 0;
+  for (; client; client = next) {
+    state = &connections.state[client];
+    next = state->next_throttled;
+    state->throttled = 0;
+    if (state->closed) continue;
+    update_interest(client);
+    if (!state->paused && !state->waiting) resume_input(client);
+  }
+}
+
+/* Gives the socket, which is non-blocking, a slot and its roster entry. */
+static int
+open_connection(int fd, int entry) {
+  unsigned generation;
+  int n;
+  n = take_slot();
+  connections.sockets[n].fd = fd;
+  connections.sockets[n].events = POLLIN;
+  generation = connections.state[n].generation;
+  memset(&connections.state[n], 0, sizeof(connections.state[n]));
+  memset(&connections.data[n], 0, sizeof(connections.data[n]));
+  strcpy(connections.data[n].nick, "anonym");
+  connections.data[n].roster = entry;
+  connections.data[n].cursor = history_head(&lobby);
+  connections.state[n].generation = generation;
+  connections.state[n].active = timers.now;
+  if (config.idle_timeout) {
+    set_timer(n, timers.now + config.idle_timeout + 1);
+  }
+  watch(n);
+  return n;
+}
+
+static int
+accept_socket(void) {
+  int fd;
+#ifdef __linux__
+  fd = accept4(connections.sockets[0].fd, NULL, NULL, SOCK_NONBLOCK);
+#else
+  fd = accept(connections.sockets[0].fd, NULL, NULL);
+  if (-1 != fd && -1 == fcntl(fd, F_SETFL, O_NONBLOCK)) {
+    die("'fcntl' failed: %s", system_error());
+  }
+#endif
+  count(COUNTER_ACCEPT_CALLS, 1);
+  return fd;
+}
+
+/* Out of descriptors, the spare one makes room to accept a connection and
+   close it right away. Returns -1 when there was none to accept, or no
+   spare. */
+static int
+refuse_client(void) {
+  int fd;
+  if (-1 == spare_descriptor) return -1;
+  close(spare_descriptor);
+  fd = accept_socket();
+  if (-1 != fd) {
+    close(fd);
+    count(COUNTER_REFUSED_CONNECTIONS, 1);
+  }
+  spare_descriptor = open("/dev/null", O_RDONLY);
+  return -1 == fd ? -1 : 0;
+}
+
+/* Stops watching the listener until the next tick, for connections left
+   queued when accepting ran short. */
+static void
+hold_off_accepting(void) {
+  timers.listen_again = timers.now + 1;
+  set_events(0, 0);
+}
+
+/* Accepts until the queue is empty. A connection aborted before it is
+   accepted is skipped, one past the limits refused. Running out of
+   memory or descriptors, the rest wait for the next tick. */
+static void
+accept_new_client(void) {
+  int client_fd, entry;
+  while (1) {
+    client_fd = accept_socket();
+    if (client_fd < 0) {
+      switch (errno) {
+      case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+        return;
+      case ENOBUFS:
+      case ENOMEM:
+        hold_off_accepting();
+        return;
+      case EMFILE:
+      case ENFILE:
+        if (-1 != refuse_client()) continue;
+        if (EAGAIN == errno || EWOULDBLOCK == errno) return;
+        hold_off_accepting();
+        return;
+      case EINTR:
+      case ECONNABORTED:
+      case EPROTO:
+      case EPERM:
+        continue;
+      default:
+        die("'accept' failed: %s", system_error());
+      }
+    }
+    entry = join_roster("anonym", 0);
+    if (-1 == entry) {
+      close(client_fd);
+      count(COUNTER_REFUSED_CONNECTIONS, 1);
+      continue;
+    }
+    set_client_options(client_fd);
+    open_connection(client_fd, entry);
+  }
+}
+
+static void
+release_pending(int client) {
+  count(COUNTER_QUEUED_BYTES, -connections.state[client].queued);
+  connections.state[client].queued = 0;
+  release_buffers(&connections.state[client].pending_to_be_sent);
+}
+
+/* Walks only the connections closed since the last sweep. */
+static void
+clean_closed_sockets(void) {
+  int client;
+  struct ConnectionState * state;
+  while (connections.closed) {
+    client = connections.closed;
+    state = &connections.state[client];
+    connections.closed = state->next;
+    if (state->paused) unlink_paused(client);
+    cancel_timer(client);
+    unsubscribe(client);
+    unfollow_roster(client);
+    leave_rooms(client);
+    /* not in close_connection, which runs under the roster lock when a
+       roster reply runs out of memory */
+    if (connections.data[client].roster) {
+      leave_roster(connections.data[client].roster);
+    }
+    if (connections.data[client].peer) unlink_peer(client);
+    unwatch(client);
+    close(connections.sockets[client].fd);
+    release_pending(client);
+    release_input_buffer(client);
+    connections.sockets[client].fd = -1;
+    connections.sockets[client].events = 0;
+    ++state->generation;
+    state->next = connections.free;
+    connections.free = client;
+  }
+}
+
+/* Sends one packet of an upgrade, with 'count' descriptors attached. */
+static void
+send_packet(const void * data, size_t size, const int * fds, int count) {
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(MAX_WORKERS * sizeof(int))];
+  } control;
+  struct msghdr message;
+  struct cmsghdr * header;
+  struct iovec part;
+  memset(&message, 0, sizeof(message));
+  part.iov_base = (void *) data;
+  part.iov_len = size;
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  if (count) {
+    message.msg_control = control.space;
+    message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+  }
+  while (-1 == sendmsg(upgrade.fd, &message, 0)) {
+    if (EINTR != errno) die("'sendmsg' failed: %s", system_error());
+  }
+}
+
+/* Receives one packet of an upgrade and up to MAX_WORKERS descriptors
+   attached to it. */
+static size_t
+receive_packet(void * data, size_t size, int * fds, int * count) {
+  union {
+    struct cmsghdr header;
+    char space[CMSG_SPACE(MAX_WORKERS * sizeof(int))];
+  } control;
+  struct msghdr message;
+  struct cmsghdr * header;
+  struct iovec part;
+  ssize_t received;
+  memset(&message, 0, sizeof(message));
+  part.iov_base = data;
+  part.iov_len = size;
+  message.msg_iov = &part;
+  message.msg_iovlen = 1;
+  message.msg_control = control.space;
+  message.msg_controllen = sizeof(control.space);
+  while (-1 == (received = recvmsg(upgrade.fd, &message, 0))) {
+    if (EINTR != errno) die("'recvmsg' failed: %s", system_error());
+  }
+  if (!received) die("the server taken over from went away");
+  if (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+    die("a packet of the upgrade was cut short");
+  }
+  *count = 0;
+  header = CMSG_FIRSTHDR(&message);
+  if (header && SOL_SOCKET == header->cmsg_level &&
+      SCM_RIGHTS == header->cmsg_type) {
+    *count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(header), *count * sizeof(int));
+  }
+  return received;
+}
+
+/* Sends 'size' bytes at 'data' in chunks, the one in 'chunk' first. */
+static void
+send_chunked(char * chunk, size_t * used, const char * data, size_t size) {
+  size_t part;
+  while (size) {
+    part = MIN(size, UPGRADE_CHUNK - *used);
+    memcpy(chunk + *used, data, part);
+    *used += part;
+    data += part;
+    size -= part;
+    if (UPGRADE_CHUNK == *used) {
+      send_packet(chunk, *used, NULL, 0);
+      *used = 0;
+    }
+  }
+}
+
+/* A record of the connection with its socket, then its input and output. */
+static void
+hand_over_connection(int client, char * chunk) {
+  unsigned char record[MAX_UPGRADE_RECORD], * at;
+  struct ConnectionState * state;
+  struct ConnectionData * data;
+  struct LinkedBuffer * buffer;
+  struct Room * room;
+  size_t input, used;
+  int slot, rooms;
+  state = &connections.state[client];
+  data = &connections.data[client];
+  input = data->input ? data->input->used : 0;
+  at = record;
+  *at++ = UPGRADE_CONNECTION;
+  *at++ = state->binary * UPGRADE_BINARY |
+    state->subscribed * UPGRADE_SUBSCRIBED |
+    state->following * UPGRADE_FOLLOWING |
+    state->compressed * UPGRADE_COMPRESSED;
+  *at++ = strlen(data->nick);
+  memcpy(at, data->nick, at[-1]);
+  at += at[-1];
+  at += put_varint(at, data->cursor);
+  at += put_varint(at, input);
+  at += put_varint(at, state->queued);
+  rooms = 0;
+  for (slot = 0; data->memberships && slot < MAX_MEMBERSHIPS; ++slot) {
+    if (!(room = data->memberships[slot].room)) continue;
+    *at++ = room->length;
+    memcpy(at, room->name, room->length);
+    at += room->length;
+    ++rooms;
+  }
+  send_packet(record, at - record, &connections.sockets[client].fd, 1);
+  used = 0;
+  if (input) send_chunked(chunk, &used, data->input->data, input);
+  for (buffer = state->pending_to_be_sent.first; buffer;
+      buffer = buffer->next) {
+    send_chunked(chunk, &used, buffer->data + buffer->sent,
+      buffer->used - buffer->sent);
+  }
+  if (used) send_packet(chunk, used, NULL, 0);
+}
+
+/* Hands all the connections of the worker over and stops it. */
+static void
+hand_over(void) {
+  char * chunk;
+  int client;
+  if (!(chunk = malloc(UPGRADE_CHUNK))) die("Out of memory");
+  pthread_mutex_lock(&upgrade.lock);
+  for (client = FIRST_CLIENT; client < connections.length; ++client) {
+    if (connections.sockets[client].fd < 0) continue;
+    if (connections.state[client].closed) continue;
+    /* a peer links to the process taking over anew */
+    if (connections.data[client].peer) continue;
+    hand_over_connection(client, chunk);
+  }
+  pthread_mutex_unlock(&upgrade.lock);
+  free(chunk);
+  finish_hand_over();
+}
+
+/* Reads the record of a connection handed over and what follows it. */
+static struct Adoption *
+receive_adoption(const unsigned char * record, size_t size, int fd) {
+  const unsigned char * at, * end;
+  struct Adoption * adoption;
+  unsigned long input, output;
+  size_t received;
+  int n, length, count, fds[MAX_WORKERS];
+  at = record + 1;
+  end = record + size;
+  if (!(adoption = calloc(1, sizeof(*adoption)))) die("Out of memory");
+  adoption->fd = fd;
+  if (end - at < 2 || MAX_NICK_LENGTH < at[1] || end - at < 2 + at[1]) {
+    goto bad;
+  }
+  adoption->flags = *at++;
+  length = *at++;
+  memcpy(adoption->nick, at, length);
+  at += length;
+  if (0 >= (n = get_varint(at, end - at, &adoption->cursor))) goto bad;
+  at += n;
+  if (0 >= (n = get_varint(at, end - at, &input))) goto bad;
+  at += n;
+  if (0 >= (n = get_varint(at, end - at, &output))) goto bad;
+  at += n;
+  while (at < end) {
+    length = *at++;
+    if (MAX_MEMBERSHIPS == adoption->rooms || MAX_ROOM_LENGTH < length ||
+        end - at < length) {
+      goto bad;
+    }
+    memcpy(adoption->room[adoption->rooms++], at, length);
+    at += length;
+  }
+  adoption->input = input;
+  adoption->output = output;
+  if (!(adoption->bytes = malloc(input + output + 1))) die("Out of memory");
+  for (received = 0; received < input + output; received += n) {
+    n = receive_packet(adoption->bytes + received, input + output - received,
+      fds, &count);
+    while (count) close(fds[--count]);
+  }
+  return adoption;
+bad:
+  die("bad record in the upgrade");
+  return NULL;
+}
+
+static void
+adopt(struct Adoption * adoption, int entry) {
+  struct ConnectionData * data;
+  int n, i;
+  n = open_connection(adoption->fd, entry);
+  data = &connections.data[n];
+  if (strcmp(data->nick, adoption->nick)) {
+    strcpy(data->nick, adoption->nick);
+    rename_in_roster(entry, data->nick);
+  }
+  /* without a journal the history starts over */
+  data->cursor = MIN(adoption->cursor, history_head(&lobby));
+  connections.state[n].binary = !!(adoption->flags & UPGRADE_BINARY);
+  connections.state[n].compressed =
+    !!(adoption->flags & UPGRADE_COMPRESSED);
+  if (adoption->output) {
+    send_bytes(n, adoption->bytes + adoption->input, adoption->output);
+  }
+  for (i = 0; i < adoption->rooms; ++i) {
+    join_room(n, adoption->room[i], strlen(adoption->room[i]));
+  }
+  if (adoption->flags & UPGRADE_SUBSCRIBED) subscribe(n);
+  if (adoption->flags & UPGRADE_FOLLOWING) follow_roster(n);
+  if (!adoption->input) return;
+  if (config.input_buffer < adoption->input ||
+      !(data->input = take_input_buffer())) {
+    close_connection(n);
+    return;
+  }
+  memcpy(data->input->data, adoption->bytes, adoption->input);
+  data->input->used = adoption->input;
+  if (-1 == process_new_data(n)) close_connection(n);
+}
+
+/* Serves the connections handed to this worker, the wheel turned to the
+   current second first. */
+static void
+adopt_connections(void) {
+  struct Adoption * adoption;
+  int entry;
+  run_timers();
+  while ((adoption = worker->adopted)) {
+    worker->adopted = adoption->next;
+    entry = join_roster("anonym", 0);
+    if (-1 == entry) close(adoption->fd);
+    else adopt(adoption, entry);
+    free(adoption->bytes);
+    free(adoption);
+  }
+}
+
+static void
+start_worker(struct Worker * self) {
+  worker = self;
+  __atomic_store_n(&worker->stats, &stats, __ATOMIC_RELEASE);
+  pool.limit = config.buffer_memory / config.workers;
+  loop_init();
+  prepare_server();
+  if (worker->adopted) adopt_connections();
+}
+
+/* One turn of the event loop: waits for events, until the next timer is due
+   when 'wait' is set, and serves them. */
+static void
+serve_events(int wait) {
+  int i, n, client, timeout;
+  short events;
+  timeout = wait ? timer_timeout() : 0;
+  if (subscribers.first || followers.first || local_rooms.first) {
+    __atomic_store_n(&worker->wanted, 1, __ATOMIC_SEQ_CST);
+    if ((subscribers.first && subscribers.pushed != history_head(&lobby)) ||
+        (followers.first && followers.pushed != roster_head()) ||
+        rooms_behind()) {
+      timeout = 0;
+    }
+  }
+  go_offline();
+  n = wait_for_events(timeout);
+  go_online();
+  run_timers();
+  if (connections.throttled) resume_throttled();
+  count(COUNTER_WAKEUPS, 1);
+  record(HISTOGRAM_READY, n);
+  for (i = 0; i < n; ++i) {
+    client = loop.ready[i].client;
+    events = loop.ready[i].events;
+    if (connections.state[client].closed) continue;
+    if (WAKEUP_SLOT == client) {
+      drain_wakeup();
+      continue;
     }
-    for (i = 0, n = connections.length; i < n; ++i) {
-      events = connections.sockets[i].revents;
-      if (events & POLLIN) {
-        if (!i) accept_new_client();
-        else handle_input(i);
-      } if (events & POLLOUT) {
-        assert(i);
-        handle_output(i);
-      } else if (events & (POLLERR | POLLHUP | POLLNVAL)) {
-        connections.data[i].closed = 1;
+    if (events & POLLIN) {
+      if (!client) accept_new_client();
+      else handle_input(client);
+    }
+    if (connections.state[client].closed) continue;
+    if (events & POLLOUT) {
+      assert(client);
+      if (connections.state[client].pending_to_be_sent.first) {
+        handle_output(client);
       }
+    } else if (client && events & (POLLERR | POLLHUP | POLLNVAL)) {
+      close_connection(client);
+    }
+  }
+  if (worker->appended) {
+    worker->appended = 0;
+    wake_workers();
+  }
+  if (subscribers.first &&
+      (subscribers.pushed != history_head(&lobby) || subscribers.lagging)) {
+    push_to_subscribers();
+  }
+  if (followers.first &&
+      (followers.pushed != roster_head() || followers.lagging)) {
+    push_to_followers();
+  }
+  if (local_rooms.first) push_to_rooms();
+  if (connections.closed) clean_closed_sockets();
+  if (pool.waiting && pool.used <= pool.limit / 4 * 3) resume_waiting();
+  /* evictions change the roster */
+  if (worker->appended) {
+    worker->appended = 0;
+    wake_workers();
+  }
+  if (__atomic_load_n(&upgrade.requested, __ATOMIC_SEQ_CST)) hand_over();
+}
+
+static void *
+run_worker(void * argument) {
+  start_worker(argument);
+  while (1) serve_events(1);
+  return NULL;
+}
+
+static void
+unix_address(struct sockaddr_un * address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (sizeof(address->sun_path) <= strlen(upgrade.path)) {
+    die("upgrade socket path is too long");
+  }
+  strcpy(address->sun_path, upgrade.path);
+}
+
+/* Takes over from a process serving the upgrade socket, if there is one:
+   the connections are spread over the workers, the listening sockets go
+   to the workers in order. */
+static void
+take_over(void) {
+  unsigned char record[MAX_UPGRADE_RECORD], version;
+  struct sockaddr_un address;
+  struct Adoption * adoption;
+  struct Worker * adopter;
+  size_t size;
+  int i, count, fds[MAX_WORKERS], n;
+  unix_address(&address);
+  upgrade.fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (-1 == upgrade.fd) die("'socket' failed: %s", system_error());
+  if (-1 == connect(upgrade.fd, (struct sockaddr *) &address,
+      sizeof(address))) {
+    if (ENOENT != errno && ECONNREFUSED != errno) {
+      die("'connect' failed: %s", system_error());
+    }
+    close(upgrade.fd);
+    return;
+  }
+  version = UPGRADE_VERSION;
+  send_packet(&version, 1, NULL, 0);
+  for (n = 0; 1; ++n) {
+    size = receive_packet(record, sizeof(record), fds, &count);
+    if (UPGRADE_LISTENERS == record[0]) break;
+    if (UPGRADE_CONNECTION != record[0] || 1 != count) {
+      die("bad record in the upgrade");
+    }
+    adoption = receive_adoption(record, size, fds[0]);
+    adopter = &workers[n % config.workers];
+    adoption->next = adopter->adopted;
+    adopter->adopted = adoption;
+  }
+  for (i = 0; i < count; ++i) {
+    if (i < config.workers) workers[i].listener = fds[i];
+    else close(fds[i]);
+  }
+  close(upgrade.fd);
+}
+
+/* Waits for a process to take over, stops the workers, then the journal
+   writer, and hands over the listening sockets. */
+static void *
+run_upgrade(void * argument) {
+  unsigned char version, listeners;
+  int i, count, fds[MAX_WORKERS];
+  (void) argument;
+  while (1) {
+    upgrade.fd = accept(upgrade.listener, NULL, NULL);
+    if (-1 == upgrade.fd) {
+      if (EINTR == errno || ECONNABORTED == errno) continue;
+      die("'accept' failed: %s", system_error());
+    }
+    if (1 == recv(upgrade.fd, &version, 1, 0) &&
+        UPGRADE_VERSION == version) {
+      break;
+    }
+    close(upgrade.fd);
+  }
+  __atomic_store_n(&upgrade.requested, 1, __ATOMIC_SEQ_CST);
+  for (i = 0; i < config.workers; ++i) wake_worker(&workers[i]);
+  /* the links just stop, their peers forget the folks */
+  for (i = config.workers + !!journal.directory; i < config.threads; ++i) {
+    wake_worker(&workers[i]);
+  }
+  pthread_mutex_lock(&upgrade.lock);
+  while (upgrade.done < config.workers) {
+    pthread_cond_wait(&upgrade.handed_over, &upgrade.lock);
+  }
+  if (journal.directory) wake_worker(&workers[config.workers]);
+  while (upgrade.done < config.workers + !!journal.directory) {
+    pthread_cond_wait(&upgrade.handed_over, &upgrade.lock);
+  }
+  pthread_mutex_unlock(&upgrade.lock);
+  listeners = UPGRADE_LISTENERS;
+  for (count = i = 0; i < config.workers; ++i) {
+    if (!i || workers[i].listener != workers[0].listener) {
+      fds[count++] = workers[i].listener;
+    }
+  }
+  send_packet(&listeners, 1, fds, count);
+  exit(EXIT_SUCCESS);
+  return NULL;
+}
+
+/* Serves the upgrade socket from now on. */
+static void
+serve_upgrades(void) {
+  struct sockaddr_un address;
+  pthread_t thread;
+  int error;
+  unix_address(&address);
+  pthread_mutex_init(&upgrade.lock, NULL);
+  pthread_cond_init(&upgrade.handed_over, NULL);
+  upgrade.listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (-1 == upgrade.listener) die("'socket' failed: %s", system_error());
+  unlink(upgrade.path);
+  if (-1 == bind(upgrade.listener, (struct sockaddr *) &address,
+      sizeof(address))) {
+    die("'bind' %s failed: %s", upgrade.path, system_error());
+  }
+  if (-1 == listen(upgrade.listener, 1)) {
+    die("'listen' failed: %s", system_error());
+  }
+  error = pthread_create(&thread, NULL, run_upgrade, NULL);
+  if (error) die("'pthread_create' failed: %s", strerror(error));
+}
+
+static void
+init_config(void) {
+  config.buffer_memory = MAX_POOL_MEMORY;
+  config.input_buffer = INPUT_BUFFER_SIZE;
+  config.high_watermark = HIGH_WATERMARK;
+  config.low_watermark = LOW_WATERMARK;
+  config.eviction_timeout = EVICTION_TIMEOUT;
+  config.max_connections = MAX_CONNECTIONS;
+  config.max_remote_folks = MAX_CONNECTIONS;
+  config.max_rooms = MAX_ROOMS;
+  config.backlog = SOMAXCONN;
+  config.history_length = MAX_HISTORY_LENGTH;
+  config.room_history_length = MAX_HISTORY_LENGTH;
+  config.workers = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+  if (0 < sysconf(_SC_NPROCESSORS_ONLN)) {
+    config.workers = MIN(sysconf(_SC_NPROCESSORS_ONLN), MAX_WORKERS);
+  }
+#endif
+}
+
+/* Takes the value of an option, from the command line or a config file. */
+static void
+set_option(int option, char * value, char * program) {
+  char * end;
+  unsigned long limit, threads;
+  switch (option) {
+  case 'a':
+    limit = strtoul(value, &end, 10);
+    if (*end) show_usage(program);
+    if (INT_MAX < limit) die("remote folks limit is too big");
+    config.max_remote_folks = limit;
+    break;
+  case 'b':
+    config.buffer_memory = strtoul(value, &end, 10);
+    if (*end || !config.buffer_memory) show_usage(program);
+    break;
+  case 'c':
+    limit = strtoul(value, &end, 10);
+    if (*end || !limit) show_usage(program);
+    if (INT_MAX - 1 < limit) die("connection limit is too big");
+    config.max_connections = limit;
+    break;
+  case 'e':
+    config.eviction_timeout = strtoul(value, &end, 10);
+    if (*end || !config.eviction_timeout) show_usage(program);
+    break;
+  case 'i':
+    config.idle_timeout = strtoul(value, &end, 10);
+    if (*end) show_usage(program);
+    break;
+  case 'w':
+    config.high_watermark = strtoul(value, &end, 10);
+    if (':' != *end) show_usage(program);
+    config.low_watermark = strtoul(end + 1, &end, 10);
+    if (*end || !config.high_watermark ||
+        config.high_watermark < config.low_watermark) {
+      show_usage(program);
+    }
+    break;
+  case 'm':
+    config.history_length = strtoul(value, &end, 10);
+    if (*end || !config.history_length) show_usage(program);
+    break;
+  case 'l':
+    config.room_history_length = strtoul(value, &end, 10);
+    if (*end || !config.room_history_length) show_usage(program);
+    break;
+  case 'n':
+    limit = strtoul(value, &end, 10);
+    if (*end) show_usage(program);
+    if (INT_MAX / 4 < limit) die("room limit is too big");
+    config.max_rooms = limit;
+    break;
+  case 'j':
+    journal.directory = value;
+    break;
+  case 'u':
+    upgrade.path = value;
+    break;
+  case 'o':
+    if (-1 == parse_socket_options(value)) show_usage(program);
+    break;
+  case 'p':
+    if (-1 == parse_peers(value)) show_usage(program);
+    break;
+  case 'q':
+    if (-1 == parse_limits(value)) show_usage(program);
+    break;
+  case 's':
+    journal.sync_interval = strtol(value, &end, 10);
+    if (*end || journal.sync_interval < 0) show_usage(program);
+    break;
+  case 'r':
+    config.input_buffer = strtoul(value, &end, 10);
+    if (*end) show_usage(program);
+    if (config.input_buffer < MAX_PACKAGE_LENGTH) {
+      die("input buffer is smaller than a package");
+    }
+    break;
+  case 't':
+    threads = strtoul(value, &end, 10);
+    if (*end || !threads) show_usage(program);
+    if (MAX_WORKERS < threads) die("too many workers");
+    config.workers = threads;
+    break;
+  default:
+    show_usage(program);
+  }
+}
+
+static void
+set_port(const char * value, char * program) {
+  char * end;
+  config.port = strtoul(value, &end, 10);
+  if (*end) show_usage(program);
+  if (!config.port) die("port 0 is not allowed");
+  if (65535 < config.port) die("port is too big");
+}
+
+/* A config file has a setting a line, the name of the option and its
+   value, like 'workers 4' or 'peers a:7000,b:7000', and may give the port.
+   Blank lines and those starting with '#' are skipped. Options after -f
+   on the command line override it. */
+static const struct {
+  const char * name;
+  int option;
+} config_names[] = {
+  { "max_remote_folks", 'a' }, { "buffer_memory", 'b' },
+  { "max_connections", 'c' },
+  { "eviction_timeout", 'e' }, { "idle_timeout", 'i' },
+  { "journal_directory", 'j' }, { "room_history_length", 'l' },
+  { "history_length", 'm' }, { "max_rooms", 'n' },
+  { "socket_options", 'o' }, { "peers", 'p' }, { "limits", 'q' },
+  { "input_buffer", 'r' }, { "sync_interval", 's' }, { "workers", 't' },
+  { "upgrade_socket", 'u' }, { "watermarks", 'w' }
+};
+
+#define CONFIG_NAMES (sizeof(config_names) / sizeof(config_names[0]))
+
+static void
+read_config_file(const char * path, char * program) {
+  char line[MAX_CONFIG_LINE], * name, * value, * copy;
+  FILE * file;
+  size_t i, length;
+  int number;
+  if (!(file = fopen(path, "r"))) {
+    die("can't open %s: %s", path, system_error());
+  }
+  for (number = 1; fgets(line, sizeof(line), file); ++number) {
+    length = strlen(line);
+    if (length && '\n' == line[length - 1]) line[--length] = '\0';
+    else if (!feof(file)) die("%s:%d: line is too long", path, number);
+    name = line + strspn(line, " \t");
+    if (!*name || '#' == *name) continue;
+    value = name + strcspn(name, " \t");
+    if (*value) *value++ = '\0';
+    value += strspn(value, " \t");
+    for (length = strlen(value); length && strchr(" \t\r", value[length - 1]);
+        --length) {
+      value[length - 1] = '\0';
+    }
+    if (!*value) die("%s:%d: %s has no value", path, number, name);
+    if (!strcmp(name, "port")) {
+      set_port(value, program);
+      continue;
+    }
+    for (i = 0; i < CONFIG_NAMES && strcmp(name, config_names[i].name); ++i) {
+    }
+    if (CONFIG_NAMES == i) die("%s:%d: unknown setting %s", path, number, name);
+    /* kept by some options */
+    if (!(copy = malloc(strlen(value) + 1))) die("Out of memory");
+    set_option(config_names[i].option, strcpy(copy, value), program);
+  }
+  if (ferror(file)) die("can't read %s: %s", path, system_error());
+  fclose(file);
+}
+
+int
+main(int argc, char * argv[]) {
+  int i, option, error;
+  init_config();
+  while (-1 != (option = getopt(argc, argv,
+      "a:b:c:e:f:i:j:l:m:n:o:p:q:r:s:t:u:w:"))) {
+    if ('f' == option) read_config_file(optarg, argv[0]);
+    else set_option(option, optarg, argv[0]);
+  }
+  if (optind + 1 == argc) set_port(argv[optind], argv[0]);
+  else if (optind != argc || !config.port) show_usage(argv[0]);
+  signal(SIGPIPE, SIG_IGN);
+  raise_descriptor_limit();
+  if (-1 == init_history(&lobby, config.history_length,
+      HISTORY_BLOCK_LENGTH)) {
+    die("Out of memory");
+  }
+  init_roster();
+  init_rooms();
+  init_federation(config.port);
+  init_stats();
+  config.threads = config.workers + !!journal.directory +
+    federation.link_count;
+  workers = calloc(config.threads, sizeof(workers[0]));
+  if (!workers) die("Out of memory");
+  for (i = 0; i < config.threads; ++i) {
+    workers[i].epoch = EPOCH_OFFLINE;
+    workers[i].listener = -1;
+  }
+  /* before the journal is read, the process taken over writes it last */
+  if (upgrade.path) take_over();
+  if (journal.directory) {
+    restore_history();
+    journal.fd = -1;
+    journal.written = lobby.next;
+    open_wakeup(workers[config.workers].wakeup);
+    error = pthread_create(&workers[config.workers].thread, NULL, run_journal,
+      &workers[config.workers]);
+    if (error) die("'pthread_create' failed: %s", strerror(error));
+  }
+  for (i = 0; i < federation.link_count; ++i) {
+    federation.links[i].worker =
+      &workers[config.workers + !!journal.directory + i];
+    open_wakeup(federation.links[i].worker->wakeup);
+    error = pthread_create(&federation.links[i].worker->thread, NULL,
+      run_link, &federation.links[i]);
+    if (error) die("'pthread_create' failed: %s", strerror(error));
+  }
+  /* without SO_REUSEPORT the workers take turns on one listening socket */
+  for (i = 0; i < config.workers; ++i) {
+#ifdef SO_REUSEPORT
+    if (-1 == workers[i].listener) {
+      workers[i].listener = open_listener(config.port);
     }
-    clean_closed_sockets();
+#else
+    if (-1 != workers[0].listener) workers[i].listener = workers[0].listener;
+    else workers[i].listener = open_listener(config.port);
+#endif
+    open_wakeup(workers[i].wakeup);
+  }
+  if (-1 == set_client_options(workers[0].listener)) {
+    die("can't set the socket options: %s", system_error());
+  }
+  for (i = 1; i < config.workers; ++i) {
+    error = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    if (error) die("'pthread_create' failed: %s", strerror(error));
   }
+  if (upgrade.path) serve_upgrades();
+  run_worker(&workers[0]);
   return 0;
 }